@@ -0,0 +1,367 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <boost/program_options.hpp>
+
+#include "GeneratorChoices.hh"
+#include "GrowthImage.hh"
+#include "ThreadPool.hh"
+
+// One fixed-seed growth to be timed.
+struct Scenario{
+  // Whether only palette pops are timed, without growing an image.
+  // Pops are made from every thread at once.  Unless the palette
+  // backend is Concurrent, each pop holds a single mutex, for
+  // comparison with the Concurrent backend.
+  bool pops_only;
+  int width;
+  int height;
+  LocationChoice location;
+  PreferenceChoice preference;
+  double epsilon;
+  PaletteBackend palette;
+  int threads;
+  int batch_size;
+
+  std::string Name() const {
+    std::stringstream ss;
+    if(pops_only){
+      ss << "pops/" << palette_backend_name(palette);
+      if(palette != PaletteBackend::Concurrent){
+        ss << "+mutex";
+      }
+      ss << "/" << width << "x" << height << "/t" << threads;
+      return ss.str();
+    }
+    ss << location << "/" << preference << "/" << palette_backend_name(palette)
+       << "/e" << epsilon << "/" << width << "x" << height;
+    if(threads > 1){
+      ss << "/t" << threads;
+    }
+    return ss.str();
+  }
+};
+
+std::string json_string(const std::string& str){
+  std::string output = "\"";
+  for(char c : str){
+    if(c == '"' || c == '\\'){
+      output += '\\';
+    }
+    output += c;
+  }
+  return output + "\"";
+}
+
+// Grows the image of a scenario, returning the results as a JSON object.
+std::string RunScenario(const Scenario& s, int seed, int build_threads){
+  GrowthImage g(s.width, s.height, seed);
+  SetChosenGenerators(g, s.location, s.preference, 10, 50, 7, build_threads, "");
+  g.SetPaletteBackend(s.palette);
+  g.SetEpsilon(s.epsilon);
+  g.SetBatchSize(s.batch_size);
+  g.SetThreads(s.threads);
+  g.SetBuildThreads(build_threads);
+  g.SetStatsMode(StatsMode::None);
+  g.SetPhaseTiming(true);
+
+  auto start = std::chrono::steady_clock::now();
+  size_t iterations = 0;
+  bool running = true;
+  while(running){
+    running = g.Iterate();
+    iterations++;
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  const PhaseTimes& phases = g.GetPhaseTimes();
+  const UniquePalette& palette = g.GetPalette();
+  // The palette is built within the first iteration, and reported
+  // separately.
+  double growth_seconds = seconds - palette.GetBuildSeconds();
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+
+  std::stringstream ss;
+  ss.precision(6);
+  ss << "{\"name\": " << json_string(s.Name())
+     << ", \"width\": " << s.width
+     << ", \"height\": " << s.height
+     << ", \"location\": " << json_string(s.location.toString())
+     << ", \"preference\": " << json_string(s.preference.toString())
+     << ", \"epsilon\": " << s.epsilon
+     << ", \"palette\": " << json_string(palette_backend_name(palette.GetEngineBackend()))
+     << ", \"threads\": " << s.threads
+     << ", \"batch_size\": " << s.batch_size
+     << ", \"seed\": " << seed
+     << ", \"iterations\": " << iterations
+     << ", \"pixels\": " << phases.pixels
+     << ", \"seconds\": " << seconds
+     << ", \"iterations_per_second\": " << iterations/growth_seconds
+     << ", \"pixels_per_second\": " << phases.pixels/growth_seconds
+     << ", \"ns_per_pop_closest\": " << 1e9*phases.palette/std::max<size_t>(phases.pixels, 1)
+     << ", \"tree_build_seconds\": " << palette.GetBuildSeconds()
+     << ", \"palette_bytes_per_color\": "
+     << double(palette.MemoryUsage())/std::max<size_t>(palette.GetPaletteSize(), 1)
+     << ", \"peak_rss_kb\": " << usage.ru_maxrss
+     << ", \"phase_seconds\": {"
+     << "\"location\": " << phases.location
+     << ", \"target_color\": " << phases.target_color
+     << ", \"palette\": " << phases.palette
+     << ", \"fill\": " << phases.fill
+     << "}}";
+  return ss.str();
+}
+
+// Pops half of a uniform palette the size of the scenario's image,
+// from every thread at once, returning the results as a JSON object.
+std::string RunPopScenario(const Scenario& s, int seed, int build_threads){
+  UniquePalette palette;
+  palette.SetBackend(s.palette);
+  palette.SetBuildThreads(build_threads);
+  palette.GenerateUniformPalette(s.width*s.height);
+
+  std::mt19937 rng(seed);
+  std::uniform_int_distribution<int> channel(0, 255);
+  std::vector<Color> queries(palette.GetPaletteSize()/2);
+  for(auto& query : queries){
+    query = {(unsigned char)channel(rng), (unsigned char)channel(rng),
+             (unsigned char)channel(rng)};
+  }
+
+  ThreadPool pool(s.threads);
+  std::mutex mutex;
+  bool locked = palette.GetEngineBackend() != PaletteBackend::Concurrent;
+  auto start = std::chrono::steady_clock::now();
+  pool.ParallelFor(queries.size(),
+                   [&](size_t i){
+                     if(locked){
+                       std::lock_guard<std::mutex> lock(mutex);
+                       palette.PopClosest(queries[i], s.epsilon);
+                     } else {
+                       palette.PopClosest(queries[i], s.epsilon);
+                     }
+                   });
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+
+  std::stringstream ss;
+  ss.precision(6);
+  ss << "{\"name\": " << json_string(s.Name())
+     << ", \"palette\": " << json_string(palette_backend_name(palette.GetEngineBackend()))
+     << ", \"locked\": " << (locked ? "true" : "false")
+     << ", \"epsilon\": " << s.epsilon
+     << ", \"threads\": " << s.threads
+     << ", \"seed\": " << seed
+     << ", \"colors\": " << palette.GetPaletteSize()
+     << ", \"pops\": " << queries.size()
+     << ", \"seconds\": " << seconds
+     << ", \"ns_per_pop_closest\": " << 1e9*seconds/std::max<size_t>(queries.size(), 1)
+     << ", \"tree_build_seconds\": " << palette.GetBuildSeconds()
+     << ", \"peak_rss_kb\": " << usage.ru_maxrss
+     << "}";
+  return ss.str();
+}
+
+// Runs the scenario in a child process, so that the peak memory
+// measured belongs to that scenario alone.
+std::string RunScenarioInChild(const Scenario& s, int seed, int build_threads){
+  int fds[2];
+  if(pipe(fds)){
+    throw std::runtime_error("Could not create pipe");
+  }
+
+  pid_t pid = fork();
+  if(pid == -1){
+    throw std::runtime_error("Could not fork");
+  }
+
+  if(pid == 0){
+    close(fds[0]);
+    int status = 0;
+    try{
+      std::string result = s.pops_only ? RunPopScenario(s, seed, build_threads)
+                                       : RunScenario(s, seed, build_threads);
+      if(write(fds[1], result.data(), result.size()) != ssize_t(result.size())){
+        status = 1;
+      }
+    } catch (std::exception& e){
+      std::cerr << "ERROR: " << s.Name() << ": " << e.what() << std::endl;
+      status = 1;
+    }
+    close(fds[1]);
+    _exit(status);
+  }
+
+  close(fds[1]);
+  std::string result;
+  char buffer[4096];
+  ssize_t n;
+  while((n = read(fds[0], buffer, sizeof(buffer))) > 0){
+    result.append(buffer, n);
+  }
+  close(fds[0]);
+
+  int status;
+  waitpid(pid, &status, 0);
+  if(!WIFEXITED(status) || WEXITSTATUS(status) || result.empty()){
+    return "{\"name\": " + json_string(s.Name()) + ", \"error\": \"failed\"}";
+  }
+  return result;
+}
+
+void ParseSize(const std::string& size, int& width, int& height){
+  char x;
+  std::stringstream ss(size);
+  if(!(ss >> width >> x >> height) || x != 'x' || !ss.eof() ||
+     width <= 0 || height <= 0){
+    throw std::runtime_error("Size must be given as WIDTHxHEIGHT, not " + size);
+  }
+}
+
+int main(int argc, char** argv){
+  std::vector<std::string> sizes;
+  std::vector<double> epsilons;
+  std::vector<LocationChoice> locations;
+  std::vector<PreferenceChoice> preferences;
+  int threads;
+  int build_threads;
+  int seed;
+  std::string output;
+  std::string label;
+
+  namespace po = boost::program_options;
+  po::options_description desc("Options");
+  desc.add_options()
+    ("output,o", po::value(&output), "Output filename of JSON results.  Defaults to stdout")
+    ("label", po::value(&label), "Label recorded with the results, such as the version benchmarked")
+    ("size", po::value(&sizes)->multitoken(),
+     "Image sizes, as WIDTHxHEIGHT.  Defaults to 256x128 and 512x512")
+    ("epsilon,e", po::value(&epsilons)->multitoken(),
+     "Epsilons (allowed error).  Defaults to 0, 5, and 20")
+    ("location,l", po::value(&locations)->multitoken(),
+     "Location algorithms.  Defaults to all")
+    ("preference,p", po::value(&preferences)->multitoken(),
+     "Preference algorithms.  Defaults to all")
+    ("threads,t", po::value(&threads)->default_value(0),
+     "Number of threads used by the concurrent palette scenarios.  Zero = One per core, at least 2")
+    ("no-concurrent", "Skip the concurrent palette scenarios, and the parallel pops compared against a mutex-guarded FlatTree")
+    ("build-threads", po::value(&build_threads)->default_value(1),
+     "Number of threads used to build the palette and Perlin field.  Zero = One per core")
+    ("seed,s", po::value(&seed)->default_value(1), "Random seed of every scenario")
+    ("help","Print help message")
+    ;
+
+  po::variables_map vm;
+  try{
+    po::store(po::parse_command_line(argc,argv,desc),vm);
+
+    if(vm.count("help")){
+      std::cout << "Growth Image Benchmark" << std::endl
+                << desc << std::endl;
+      return 0;
+    }
+
+    po::notify(vm);
+  } catch (po::error& e){
+    std::cerr << "ERROR: " << e.what() << std::endl
+              << desc << std::endl;
+    return 1;
+  }
+
+  if(sizes.empty()){
+    sizes = {"256x128", "512x512"};
+  }
+  if(epsilons.empty()){
+    epsilons = {0, 5, 20};
+  }
+  if(locations.empty()){
+    locations = {LocationChoice::Random, LocationChoice::Preferred,
+                 LocationChoice::Priority, LocationChoice::Sequential};
+  }
+  if(preferences.empty()){
+    preferences = {PreferenceChoice::Location, PreferenceChoice::Perlin,
+                   PreferenceChoice::PerlinField};
+  }
+  if(threads <= 0){
+    threads = std::max(2u, std::thread::hardware_concurrency());
+  }
+  if(build_threads <= 0){
+    build_threads = std::thread::hardware_concurrency();
+  }
+  // A fixed seed, so that every run grows the same images.
+  if(seed == 0){
+    seed = 1;
+  }
+
+  std::vector<Scenario> scenarios;
+  try{
+    for(const auto& size : sizes){
+      int width, height;
+      ParseSize(size, width, height);
+      for(double epsilon : epsilons){
+        for(auto location : locations){
+          for(auto preference : preferences){
+            scenarios.push_back({false, width, height, location, preference, epsilon,
+                                 PaletteBackend::Auto, 1, 1});
+          }
+        }
+        if(!vm.count("no-concurrent")){
+          scenarios.push_back({false, width, height, LocationChoice::Random, PreferenceChoice::Location,
+                               epsilon, PaletteBackend::Concurrent, threads, 32*threads});
+        }
+      }
+      if(!vm.count("no-concurrent")){
+        for(auto backend : {PaletteBackend::Concurrent, PaletteBackend::FlatTree}){
+          scenarios.push_back({true, width, height, LocationChoice::Random, PreferenceChoice::Location,
+                               0, backend, threads, 1});
+        }
+      }
+    }
+  } catch (std::runtime_error& e){
+    std::cerr << "ERROR: " << e.what() << std::endl;
+    return 1;
+  }
+
+  std::ofstream file;
+  if(!output.empty()){
+    file.open(output);
+    if(!file){
+      std::cerr << "ERROR: Could not open " << output << std::endl;
+      return 1;
+    }
+  }
+  std::ostream& out = output.empty() ? std::cout : file;
+
+  out << "{\"label\": " << json_string(label) << ",\n"
+      << " \"scenarios\": [\n";
+  for(size_t i=0; i<scenarios.size(); i++){
+    std::cerr << "[" << i+1 << "/" << scenarios.size() << "] "
+              << scenarios[i].Name() << std::endl;
+    try{
+      out << "  " << RunScenarioInChild(scenarios[i], seed, build_threads)
+          << (i+1 < scenarios.size() ? ",\n" : "\n") << std::flush;
+    } catch (std::runtime_error& e){
+      std::cerr << "ERROR: " << e.what() << std::endl;
+      return 1;
+    }
+  }
+  out << " ]}" << std::endl;
+}
@@ -0,0 +1,132 @@
+#ifndef _CHECKPOINT_H_
+#define _CHECKPOINT_H_
+
+#include <cstdint>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// Writes a binary checkpoint file.
+//
+// Values are written in native byte order.  Each array is preceded by
+// its length, and starts at a multiple of 8 bytes from the start of
+// the file, so that a mapped file can be read in place.  The file is
+// written to a temporary name and renamed once complete, so an
+// interrupted write leaves any earlier checkpoint intact.
+class CheckpointWriter{
+public:
+  CheckpointWriter(const std::string& filename);
+  ~CheckpointWriter();
+
+  CheckpointWriter(const CheckpointWriter&) = delete;
+  CheckpointWriter& operator=(const CheckpointWriter&) = delete;
+
+  template<typename T>
+  void Write(const T& value){
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "Only trivially copyable types can be written directly");
+    write_bytes(&value, sizeof(T));
+  }
+
+  template<typename T>
+  void WriteArray(const T* data, size_t n){
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "Only trivially copyable types can be written directly");
+    Write<uint64_t>(n);
+    align();
+    write_bytes(data, n*sizeof(T));
+    align();
+  }
+
+  template<typename T>
+  void WriteVector(const std::vector<T>& vec){
+    WriteArray(vec.data(), vec.size());
+  }
+
+  void WriteString(const std::string& str){
+    WriteArray(str.data(), str.size());
+  }
+
+  // Finishes the file, replacing any previous file of the same name.
+  void Close();
+
+private:
+  void write_bytes(const void* data, size_t n);
+  void align();
+
+  std::string filename;
+  std::string temp_filename;
+  FILE* file;
+  size_t offset;
+};
+
+// Reads a file written by CheckpointWriter.  Values must be read in
+// the order they were written.
+class CheckpointReader{
+public:
+  CheckpointReader(const std::string& filename);
+  ~CheckpointReader();
+
+  CheckpointReader(const CheckpointReader&) = delete;
+  CheckpointReader& operator=(const CheckpointReader&) = delete;
+
+  template<typename T>
+  T Read(){
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "Only trivially copyable types can be read directly");
+    T value;
+    read_bytes(&value, sizeof(T));
+    return value;
+  }
+
+  template<typename T>
+  std::vector<T> ReadVector(){
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "Only trivially copyable types can be read directly");
+    uint64_t n = Read<uint64_t>();
+    if(n > remaining_bytes()/sizeof(T)){
+      throw std::runtime_error("Checkpoint is truncated");
+    }
+    align();
+    std::vector<T> output(n);
+    read_bytes(output.data(), n*sizeof(T));
+    align();
+    return output;
+  }
+
+  // Reads an array, which must have the length given.
+  template<typename T>
+  void ReadArray(T* data, size_t n){
+    if(Read<uint64_t>() != n){
+      throw std::runtime_error("Checkpoint does not match this image");
+    }
+    align();
+    read_bytes(data, n*sizeof(T));
+    align();
+  }
+
+  std::string ReadString(){
+    auto chars = ReadVector<char>();
+    return std::string(chars.begin(), chars.end());
+  }
+
+private:
+  void read_bytes(void* data, size_t n);
+  void align();
+  size_t remaining_bytes() const { return size - offset; }
+
+  FILE* file;
+  size_t offset;
+  size_t size;
+};
+
+// Saves and restores state held by a location, preference, or target
+// color generator.  Generators without state need no overload.
+template<typename T>
+void SaveGeneratorState(CheckpointWriter&, const T&) { }
+template<typename T>
+void LoadGeneratorState(CheckpointReader&, T&) { }
+
+#endif /* _CHECKPOINT_H_ */
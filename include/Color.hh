@@ -23,6 +23,10 @@ struct Color{
     }
   }
 
+  bool operator==(const Color& other) const {
+    return r == other.r && g == other.g && b == other.b;
+  }
+
   unsigned char GetR() const { return r; }
   unsigned char GetG() const { return g; }
   unsigned char GetB() const { return b; }
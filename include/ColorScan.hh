@@ -0,0 +1,35 @@
+#ifndef _COLORSCAN_H_
+#define _COLORSCAN_H_
+
+#include <climits> // for INT_MAX
+#include <cstddef> // for size_t
+
+#include "Color.hh"
+
+struct ColorScanResult{
+  // Squared distance to the closest color, or INT_MAX if every color was used.
+  int dist2;
+  // Index of the closest color.  If several are equally close, the
+  // lowest index is returned.
+  size_t index;
+};
+
+// Finds the color closest to the query, out of n colors stored as
+// separate r/g/b arrays.  Colors with a nonzero entry in "used" are
+// skipped.  "used" may be null, in which case every color is eligible.
+//
+// Uses AVX2 or SSE2 when the CPU supports them, with a scalar fallback.
+ColorScanResult ClosestColor(const unsigned char* r,
+                             const unsigned char* g,
+                             const unsigned char* b,
+                             const unsigned char* used,
+                             size_t n, Color query);
+
+// Same as ClosestColor, but always uses the scalar implementation.
+ColorScanResult ClosestColorScalar(const unsigned char* r,
+                                   const unsigned char* g,
+                                   const unsigned char* b,
+                                   const unsigned char* used,
+                                   size_t n, Color query);
+
+#endif /* _COLORSCAN_H_ */
@@ -2,25 +2,56 @@
 #define _COMPILEDALGORITHMS_H_
 
 #include <algorithm>
+#include <cassert>
+#include <cfloat>
 #include <functional>
+#include <memory>
 #include <random>
+#include <string>
 #include <vector>
 
+#include "Checkpoint.hh"
 #include "Color.hh"
 #include "GrowthImage.hh"
+#include "ImageBuffer.hh"
+#include "NeighborColors.hh"
 #include "Point.hh"
 
 std::vector<Color> generate_uniform_palette(RandomInt, int n_colors);
 
 std::vector<Point> generate_random_start(RandomInt rand, int width, int height);
 
-Point generate_frontier_location(RandomInt rand, const PointTracker& point_tracker);
+// The generators below are called for every pixel, and are defined
+// here so that they can be inlined into GrowthImage::IterateWith.
+
+inline Point generate_frontier_location(RandomInt& rand, const PointTracker& point_tracker){
+  return point_tracker.FrontierAtIndex(
+    rand(0, point_tracker.FrontierSize()));
+}
 
 class generate_sequential_location{
 public:
   generate_sequential_location(int width, int height)
     : width(width), height(height), i(-1), j(0) { }
-  Point operator()(RandomInt rand, const PointTracker& point_tracker);
+
+  Point operator()(RandomInt&, const PointTracker&){
+    i++;
+    if(i==width){
+      i = 0;
+      j++;
+    }
+    return {i,j};
+  }
+
+  friend void SaveGeneratorState(CheckpointWriter& writer, const generate_sequential_location& gen){
+    writer.Write<int>(gen.i);
+    writer.Write<int>(gen.j);
+  }
+  friend void LoadGeneratorState(CheckpointReader& reader, generate_sequential_location& gen){
+    gen.i = reader.Read<int>();
+    gen.j = reader.Read<int>();
+  }
+
 private:
   int width, height;
   int i,j;
@@ -30,16 +61,58 @@ class generate_preferred_location{
 public:
   generate_preferred_location(int n)
     : n(std::max(n,1)) { }
-  Point operator()(RandomInt rand, const PointTracker& p);
+
+  Point operator()(RandomInt& rand, const PointTracker& point_tracker){
+    int best_index = 0;
+    double best_preference = -DBL_MAX;
+    for(int i=0; i<n; i++){
+      int index = rand(0, point_tracker.FrontierSize() );
+      auto p = point_tracker.FrontierAtIndex(index);
+
+      if(p.preference > best_preference){
+        best_preference = p.preference;
+        best_index = index;
+      }
+    }
+
+    return point_tracker.FrontierAtIndex(best_index);
+  }
+
 private:
   int n;
 };
 
-double generate_null_preference(RandomInt, Point p, const PointTracker& point_tracker);
+// Returns the frontier point with the highest preference.  Requires
+// the frontier to be ordered with FrontierOrder::MaxPreference.
+inline Point generate_priority_location(RandomInt&, const PointTracker& point_tracker){
+  assert(point_tracker.GetFrontierOrder() == FrontierOrder::MaxPreference);
+  return point_tracker.FrontierAtIndex(0);
+}
+
+inline double generate_null_preference(RandomInt&, Point, const PointTracker&){
+  return 0;
+}
 
 class generate_location_preference{
 public:
-  double operator()(RandomInt rand, Point p, const PointTracker& point_tracker);
+  double operator()(RandomInt& rand, Point p, const PointTracker& point_tracker){
+    if(goal_loc == -1 || point_tracker.IsFilled(goal_loc.i, goal_loc.j)){
+      goal_loc = {rand(0, point_tracker.GetWidth()),
+                  rand(0, point_tracker.GetHeight())};
+    }
+
+    double di = p.i - goal_loc.i;
+    double dj = p.j - goal_loc.j;
+    return -(di*di + dj*dj);
+  }
+
+  friend void SaveGeneratorState(CheckpointWriter& writer, const generate_location_preference& gen){
+    writer.Write<Point>(gen.goal_loc);
+  }
+  friend void LoadGeneratorState(CheckpointReader& reader, generate_location_preference& gen){
+    gen.goal_loc = reader.Read<Point>();
+  }
+
 private:
   Point goal_loc;
 };
@@ -52,13 +125,82 @@ public:
     perlin.SetOctaves(octaves);
   }
 
-  double operator()(RandomInt, Point p, const PointTracker&){
+  double operator()(RandomInt&, Point p, const PointTracker&){
     return perlin(p.i, p.j);
   }
+
+  friend void SaveGeneratorState(CheckpointWriter& writer, const generate_perlin_preference& gen){
+    gen.perlin.SaveState(writer);
+  }
+  friend void LoadGeneratorState(CheckpointReader& reader, generate_perlin_preference& gen){
+    gen.perlin.LoadState(reader);
+  }
 private:
   PerlinNoise perlin;
 };
 
-Color generate_average_color(RandomInt rand, std::vector<Color> neighbors, Point p);
+// The same preference as generate_perlin_preference, but evaluated
+// for every pixel when first needed, one row at a time across the
+// threads given.  Each preference is then a single lookup.  Values are kept as
+// floats to halve the memory, so points whose preferences differ by
+// less than float precision become ties.
+class generate_perlin_field_preference{
+public:
+  // If map_directory is given, the values are held in a mapped file,
+  // as for ImageBuffer.
+  generate_perlin_field_preference(int width, int height, double grid_size, int octaves,
+                                   std::mt19937& rng, int threads = 1,
+                                   const std::string& map_directory = "");
+
+  double operator()(RandomInt&, Point p, const PointTracker&){
+    // Points outside the image are never added to the frontier.
+    if(p.i < 0 || p.j < 0 || p.i >= width || p.j >= height){
+      return 0;
+    }
+    if(!field){
+      compute_field();
+    }
+    return (*field)(p.i, p.j);
+  }
+
+  // Only the noise is saved, and the field computed again after loading.
+  friend void SaveGeneratorState(CheckpointWriter& writer,
+                                 const generate_perlin_field_preference& gen){
+    gen.perlin.SaveState(writer);
+  }
+  friend void LoadGeneratorState(CheckpointReader& reader, generate_perlin_field_preference& gen){
+    gen.perlin.LoadState(reader);
+    gen.field = nullptr;
+  }
+
+private:
+  void compute_field();
+
+  PerlinNoise perlin;
+  int width;
+  int height;
+  int threads;
+  std::string map_directory;
+  // Shared between copies of the generator made after it is computed.
+  std::shared_ptr<ImageBuffer<float> > field;
+};
+
+inline Color generate_average_color(RandomInt& rand, const NeighborColors& neighbors, Point){
+  if(neighbors.size()){
+    Color output(0,0,0);
+    for(auto col : neighbors){
+      output.r += col.r/neighbors.size();
+      output.g += col.g/neighbors.size();
+      output.b += col.b/neighbors.size();
+    }
+    return output;
+  } else {
+    return {
+      (unsigned char)rand(0,255),
+      (unsigned char)rand(0,255),
+      (unsigned char)rand(0,255)
+    };
+  }
+}
 
 #endif /* _COMPILEDALGORITHMS_H_ */
@@ -0,0 +1,453 @@
+#ifndef _FLATKDTREE_H_
+#define _FLATKDTREE_H_
+
+#include <algorithm> // for std::nth_element
+#include <cassert>
+#include <cstddef> // for size_t
+#include <deque>
+#include <memory>
+#include <numeric> // for std::iota
+#include <vector>
+
+#include "KDTree.hh"
+
+// A KD-tree with the same splitting rules and search semantics as
+// KDTree<T>, but stored as two flat arrays instead of heap-allocated
+// nodes.  Nodes are stored in build (pre-order) sequence.  The values of
+// each leaf are a contiguous slice of a single array.  There are no
+// virtual calls, and a search walks through contiguous memory.
+//
+// Popped values are swapped to the end of their leaf, so each leaf
+// only scans its remaining values.  Once the tree becomes sparse, it is
+// rebuilt from the remaining values.
+//
+// A lazy tree starts out as a single pending node, and splits each
+// pending node the first time that a search reaches it.  Each range is
+// split exactly as by the full build, so searches give the same
+// results.  Nodes split later are appended to the arrays, so are no
+// longer in pre-order.
+template<typename T>
+class FlatKDTree{
+public:
+  // If a thread pool is given, it is used to build and rebuild the
+  // tree in parallel.  If lazy, the pool is not used.
+  FlatKDTree(std::vector<T> vec, std::shared_ptr<ThreadPool> pool = nullptr,
+             bool lazy = false)
+    : pool(pool), lazy(lazy), generation(0), num_pending(0),
+      values(build(std::move(vec))) { }
+
+  FlatKDTree(CheckpointReader& reader, std::shared_ptr<ThreadPool> pool = nullptr,
+             bool lazy = false)
+    : pool(pool), lazy(lazy), nodes(reader.ReadVector<Node>()),
+      built_size(reader.Read<uint64_t>()), generation(0), num_pending(count_pending()),
+      values(reader) { }
+
+  void Save(CheckpointWriter& writer) const {
+    writer.WriteVector(nodes);
+    writer.Write<uint64_t>(built_size);
+    values.Save(writer);
+  }
+
+  KDTree_Result<T> PopClosest(T query, double epsilon = 0){
+    KDTree_Result<T> output;
+    auto res = closest_node(0, query, epsilon, output.stats);
+    output.res = values.Get(res.index);
+    pop_index(res.leaf, res.index);
+    return output;
+  }
+
+  // Finds the closest value to each of n queries, without removing
+  // any.  The queries share one walk down the tree, which visits each
+  // node once for all of the queries that reach it, so queries that
+  // are close together are best given together.  Each query stops
+  // searching a branch once it has a close enough value from anywhere,
+  // so with epsilon above 0 the values found may differ from
+  // GetClosest(), but do not depend on the other queries given.
+  void FindClosest(const T* queries, size_t n, double epsilon, KDTree_Found<T>* output){
+    if(n == 0){
+      return;
+    }
+    std::fill(output, output+n, KDTree_Found<T>());
+    std::vector<SearchRes> best(n, {DBL_MAX, -1, 0});
+    std::vector<size_t> ids(n);
+    std::iota(ids.begin(), ids.end(), 0);
+    std::deque<std::vector<size_t> > scratch;
+    closest_batch(0, ids, 0, scratch, queries, epsilon, best.data(), output);
+
+    for(size_t i=0; i<n; i++){
+      output[i].result.res = values.Get(best[i].index);
+      output[i].leaf = best[i].leaf;
+      output[i].index = best[i].index;
+      output[i].generation = generation;
+    }
+  }
+
+  // Pops the value found by FindClosest(), or if it has been removed
+  // since, searches for the query again.
+  KDTree_Result<T> PopFound(const KDTree_Found<T>& found, T query, double epsilon = 0){
+    if(found.generation == generation &&
+       found.leaf >= 0 && size_t(found.leaf) < nodes.size() &&
+       is_leaf(nodes[found.leaf])){
+      // Popping other values of the leaf may have moved the value,
+      // but only within the remaining values of the leaf.
+      const Node& leaf = nodes[found.leaf];
+      size_t end = leaf.link + leaf.num_leaves;
+      size_t index = found.index;
+      if(index >= end || !(values.Get(index) == found.result.res)){
+        for(index = leaf.link; index < end; index++){
+          if(values.Get(index) == found.result.res){
+            break;
+          }
+        }
+      }
+      if(index < end){
+        pop_index(found.leaf, index);
+        return found.result;
+      }
+    }
+
+    auto output = PopClosest(query, epsilon);
+    output.stats += found.result.stats;
+    return output;
+  }
+
+  KDTree_Result<T> GetClosest(T query, double epsilon = 0){
+    KDTree_Result<T> output;
+    auto res = closest_node(0, query, epsilon, output.stats);
+    output.res = values.Get(res.index);
+    return output;
+  }
+
+  int GetNumLeaves(){
+    return nodes[0].num_leaves;
+  }
+
+  // Splits every pending node, after which searches do not modify the
+  // tree.  Returns at once if no node is pending.
+  void FinishBuild(){
+    for(size_t i=0; num_pending && i<nodes.size(); i++){
+      if(is_pending(nodes[i])){
+        split_pending(i);
+      }
+    }
+  }
+
+  size_t MemoryUsage() const {
+    return nodes.capacity()*sizeof(Node) + values.MemoryUsage();
+  }
+
+private:
+  struct Node{
+    // Index of the parent node, or -1 for the root.
+    int parent;
+    // Index of the right child.  Zero for leaf nodes, since the root
+    // is never a child, and pending for nodes not yet split.
+    int right;
+    int num_leaves;
+    // For pending nodes, the first dimension to try splitting.
+    int dimension;
+    double median;
+    // For internal nodes, the index of the left child.  For leaf and
+    // pending nodes, the start of the values held.  The remaining
+    // values are [link, link+num_leaves).
+    size_t link;
+  };
+  static const int pending = -1;
+
+  struct SearchRes{
+    double dist2;
+    int leaf;
+    size_t index;
+  };
+
+  bool is_leaf(const Node& node) const {
+    return node.right == 0;
+  }
+
+  bool is_pending(const Node& node) const {
+    return node.right == pending;
+  }
+
+  int make_leaf(size_t begin, size_t end, int parent){
+    assert(end > begin);
+    int index = nodes.size();
+    nodes.push_back({parent, 0, int(end-begin), 0, 0, begin});
+    return index;
+  }
+
+  // Removes the value at the index, which must be among the remaining
+  // values of the leaf.
+  void pop_index(int leaf_index, size_t index){
+    Node& leaf = nodes[leaf_index];
+    values.Swap(index, leaf.link + leaf.num_leaves - 1);
+    for(int node = leaf_index; node != -1; node = nodes[node].parent){
+      nodes[node].num_leaves--;
+    }
+
+    int remaining = GetNumLeaves();
+    if(remaining > 0 && remaining < built_size*kdtree_rebuild_fraction){
+      rebuild();
+    }
+  }
+
+  // Builds all nodes, and returns the values in leaf order.
+  std::vector<T> build(std::vector<T> vec){
+    assert(vec.size() > 0);
+    built_size = vec.size();
+    generation++;
+    nodes.clear();
+    num_pending = 0;
+    if(lazy){
+      nodes.push_back({-1, pending, int(vec.size()), 0, 0, 0});
+      num_pending = 1;
+      return vec;
+    }
+    auto splits = kdtree_partition(vec.data(), vec.size(), pool.get());
+    size_t next_split = 0;
+    make_node(0, vec.size(), -1, splits, next_split);
+    return vec;
+  }
+
+  void rebuild(){
+    // Pending values are partitioned first, so that the remaining
+    // values are in the same order as for a tree built in full.
+    FinishBuild();
+    std::vector<T> remaining;
+    remaining.reserve(GetNumLeaves());
+    collect_remaining(0, remaining);
+    values = LeafValues<T>(build(std::move(remaining)));
+  }
+
+  // Appends the remaining values below a node, in the order of the
+  // leaves.
+  void collect_remaining(int index, std::vector<T>& remaining) const {
+    const Node& node = nodes[index];
+    if(is_leaf(node)){
+      for(int i=0; i<node.num_leaves; i++){
+        remaining.push_back(values.Get(node.link + i));
+      }
+    } else {
+      collect_remaining(node.link, remaining);
+      collect_remaining(node.right, remaining);
+    }
+  }
+
+  // Builds the nodes of base[begin, begin+n), which has already been
+  // partitioned with the splits given.
+  int make_node(size_t begin, size_t n, int parent,
+                const std::vector<KDTreeSplit>& splits, size_t& next_split){
+    assert(n>0);
+    KDTreeSplit split = splits[next_split++];
+    size_t median_index = split.median_index;
+    int dimension = split.dimension;
+    if(!median_index){
+      // Either few enough values for a leaf, or every value is equal.
+      return make_leaf(begin, begin+n, parent);
+    }
+
+    int index = nodes.size();
+    nodes.push_back({parent, 0, int(n), dimension, split.median, size_t(index+1)});
+    make_node(begin, median_index, index, splits, next_split);
+    int right = make_node(begin+median_index, n-median_index, index, splits, next_split);
+    nodes[index].right = right;
+    return index;
+  }
+
+  // Splits a pending node in the same way as make_node(), giving it
+  // two pending children, or makes it a leaf.
+  void split_pending(int index){
+    Node node = nodes[index];
+    num_pending--;
+    size_t n = node.num_leaves;
+    int dimension = 0;
+    size_t median_index = 0;
+    if(n >= kdtree_leaf_size){
+      std::vector<T> arr(n);
+      for(size_t i=0; i<n; i++){
+        arr[i] = values.Get(node.link + i);
+      }
+      median_index = kdtree_split(arr.data(), n, node.dimension, dimension);
+      // Written back even if not split, since the values have still
+      // been reordered.
+      for(size_t i=0; i<n; i++){
+        values.Set(node.link + i, arr[i]);
+      }
+      node.median = median_index ? double(arr[median_index].get(dimension)) : 0;
+    }
+
+    if(!median_index){
+      nodes[index].right = 0;
+      return;
+    }
+
+    int left = nodes.size();
+    int next_dim = (dimension+1) % T::dimensions;
+    nodes.push_back({index, pending, int(median_index), next_dim, 0, node.link});
+    nodes.push_back({index, pending, int(n-median_index), next_dim, 0, node.link + median_index});
+    num_pending += 2;
+    nodes[index] = {node.parent, left+1, int(n), dimension, node.median, size_t(left)};
+  }
+
+  size_t count_pending() const {
+    return std::count_if(nodes.begin(), nodes.end(),
+                         [this](const Node& node){ return is_pending(node); });
+  }
+
+  SearchRes closest_node(int index, T query, double epsilon, PerformanceStats& stats){
+    if(is_pending(nodes[index])){
+      split_pending(index);
+    }
+    // Splitting nodes below may move the array, so the node is not
+    // used after searching either child.
+    const Node& node = nodes[index];
+    assert(node.num_leaves > 0);
+
+    stats.nodes_checked += 1;
+
+    if(is_leaf(node)){
+      stats.leaf_nodes_checked += 1;
+      stats.points_checked += node.num_leaves;
+
+      auto res = values.Closest(query, node.link, node.link + node.num_leaves);
+      return {res.first, index, res.second};
+    }
+
+    int left = node.link;
+    int right = node.right;
+
+    // If one of the branches is empty, this becomes really easy.
+    if(nodes[left].num_leaves == 0){
+      return closest_node(right, query, epsilon, stats);
+    } else if(nodes[right].num_leaves == 0){
+      return closest_node(left, query, epsilon, stats);
+    }
+
+    // Check on the side that is recommended by the median heuristic.
+    double diff = query.get(node.dimension) - node.median;
+    auto res1 = closest_node((diff<0) ? left : right, query, epsilon, stats);
+    double allowed_diff = diff*(1+epsilon);
+    if(allowed_diff * allowed_diff > res1.dist2){
+      return res1;
+    }
+
+    // Couldn't bail out early, so check on the other side and compare.
+    auto res2 = closest_node((diff<0) ? right : left, query, epsilon, stats);
+    return (res1.dist2 < res2.dist2) ? res1 : res2;
+  }
+
+  // Searches below a node for each of the queries given by ids,
+  // keeping the closest value found for each in best.  At each split,
+  // every query visits the side recommended by the median heuristic
+  // first, as in closest_node().  scratch holds the lists of queries
+  // passed further down, two for each depth.
+  void closest_batch(int index, const std::vector<size_t>& ids, size_t depth,
+                     std::deque<std::vector<size_t> >& scratch,
+                     const T* queries, double epsilon,
+                     SearchRes* best, KDTree_Found<T>* output){
+    if(is_pending(nodes[index])){
+      split_pending(index);
+    }
+    // Copied, since splitting nodes below may move the array.
+    const Node node = nodes[index];
+    assert(node.num_leaves > 0);
+
+    for(size_t id : ids){
+      output[id].result.stats.nodes_checked += 1;
+    }
+
+    if(is_leaf(node)){
+      for(size_t id : ids){
+        PerformanceStats& stats = output[id].result.stats;
+        stats.leaf_nodes_checked += 1;
+        stats.points_checked += node.num_leaves;
+
+        auto res = values.Closest(queries[id], node.link, node.link + node.num_leaves);
+        if(res.first < best[id].dist2){
+          best[id] = {res.first, index, res.second};
+        }
+      }
+      return;
+    }
+
+    int left = node.link;
+    int right = node.right;
+
+    // If one of the branches is empty, this becomes really easy.
+    if(nodes[left].num_leaves == 0){
+      closest_batch(right, ids, depth+1, scratch, queries, epsilon, best, output);
+      return;
+    } else if(nodes[right].num_leaves == 0){
+      closest_batch(left, ids, depth+1, scratch, queries, epsilon, best, output);
+      return;
+    }
+
+    while(scratch.size() < 2*depth+2){
+      scratch.emplace_back();
+    }
+    std::vector<size_t>& first = scratch[2*depth];
+    std::vector<size_t>& second = scratch[2*depth+1];
+
+    auto diff = [&](size_t id){
+      return queries[id].get(node.dimension) - node.median;
+    };
+    // Whether the query still needs to check the side away from the
+    // median heuristic.
+    auto needs_far_side = [&](size_t id){
+      double allowed_diff = diff(id)*(1+epsilon);
+      return allowed_diff * allowed_diff <= best[id].dist2;
+    };
+
+    // Queries that check the left side first.
+    first.clear();
+    for(size_t id : ids){
+      if(diff(id) < 0){
+        first.push_back(id);
+      }
+    }
+    if(!first.empty()){
+      closest_batch(left, first, depth+1, scratch, queries, epsilon, best, output);
+    }
+
+    // Queries that check the right side first, followed by those
+    // that still need to check it after the left side.
+    second.clear();
+    for(size_t id : ids){
+      if(diff(id) >= 0){
+        second.push_back(id);
+      }
+    }
+    size_t num_right_first = second.size();
+    for(size_t id : first){
+      if(needs_far_side(id)){
+        second.push_back(id);
+      }
+    }
+    if(!second.empty()){
+      closest_batch(right, second, depth+1, scratch, queries, epsilon, best, output);
+    }
+
+    // Queries that checked the right side first, and still need to
+    // check the left side.
+    first.clear();
+    for(size_t i=0; i<num_right_first; i++){
+      if(needs_far_side(second[i])){
+        first.push_back(second[i]);
+      }
+    }
+    if(!first.empty()){
+      closest_batch(left, first, depth+1, scratch, queries, epsilon, best, output);
+    }
+  }
+
+  std::shared_ptr<ThreadPool> pool;
+  bool lazy;
+  std::vector<Node> nodes;
+  size_t built_size;
+  unsigned int generation;
+  // Number of pending nodes, so that FinishBuild() of a tree built in
+  // full does not scan the nodes.
+  size_t num_pending;
+  LeafValues<T> values;
+};
+
+#endif /* _FLATKDTREE_H_ */
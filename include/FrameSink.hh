@@ -0,0 +1,104 @@
+#ifndef _FRAMESINK_H_
+#define _FRAMESINK_H_
+
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Color.hh"
+
+// Receives the frames of a video, one full image at a time, and
+// encodes them as they arrive.
+class FrameSink{
+public:
+  FrameSink(int width, int height)
+    : width(width), height(height) { }
+  virtual ~FrameSink() { }
+
+  virtual void WriteFrame(const std::vector<Color>& pixels) = 0;
+
+  // Finishes the video.  Errors from the encoder are reported here.
+  virtual void Close() = 0;
+
+  int GetWidth() const { return width; }
+  int GetHeight() const { return height; }
+
+protected:
+  int width;
+  int height;
+};
+
+// Pipes raw RGB24 frames into the stdin of an ffmpeg process, which
+// encodes them to h264.
+class FFmpegFrameSink : public FrameSink{
+public:
+  FFmpegFrameSink(const std::string& output, int width, int height, int framerate);
+  virtual ~FFmpegFrameSink();
+
+  virtual void WriteFrame(const std::vector<Color>& pixels);
+  virtual void Close();
+
+private:
+  FILE* pipe;
+};
+
+// Writes an uncompressed YUV4MPEG2 stream, with full resolution
+// chroma (C444), to a file.
+class Y4MFrameSink : public FrameSink{
+public:
+  Y4MFrameSink(const std::string& output, int width, int height, int framerate);
+  virtual ~Y4MFrameSink();
+
+  virtual void WriteFrame(const std::vector<Color>& pixels);
+  virtual void Close();
+
+private:
+  FILE* file;
+  std::vector<unsigned char> planes;
+};
+
+// Opens a sink for a video file.  Files ending in .y4m are written
+// directly, anything else is encoded by ffmpeg.
+std::unique_ptr<FrameSink> OpenFrameSink(const std::string& output, int width, int height, int framerate);
+
+// Passes frames to another sink from a background thread, so that
+// encoding overlaps with growing the image.  WriteFrame only copies the
+// frame into one of a fixed number of buffers.  If every buffer is
+// waiting to be encoded, WriteFrame blocks until one is free.
+class AsyncFrameSink : public FrameSink{
+public:
+  AsyncFrameSink(std::unique_ptr<FrameSink> sink, int num_buffers = 3);
+  virtual ~AsyncFrameSink();
+
+  virtual void WriteFrame(const std::vector<Color>& pixels);
+  virtual void Close();
+
+private:
+  void WriterLoop();
+  void StopWriter();
+
+  std::unique_ptr<FrameSink> sink;
+
+  std::vector<std::vector<Color> > buffers;
+  std::vector<int> free_buffers;
+  // Buffers holding frames not yet written, oldest first.
+  std::deque<int> queued_buffers;
+
+  std::mutex mutex;
+  std::condition_variable buffer_freed;
+  std::condition_variable frame_queued;
+  bool finished;
+  // Error thrown by the background thread, rethrown by the next call
+  // to WriteFrame or Close.
+  std::exception_ptr error;
+
+  std::thread writer;
+};
+
+#endif /* _FRAMESINK_H_ */
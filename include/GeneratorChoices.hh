@@ -0,0 +1,25 @@
+#ifndef _GENERATORCHOICES_H_
+#define _GENERATORCHOICES_H_
+
+#include <string>
+
+#include "GrowthImage.hh"
+#include "SmartEnum.hh"
+
+SmartEnum(LocationChoice, Random, Preferred, Priority, Sequential);
+SmartEnum(PreferenceChoice, Location, Perlin, PerlinField);
+
+// Gives the compiled generators chosen to the image, with each
+// combination of location and preference compiled separately.  Also
+// sets the frontier order needed by the location chosen.
+//   preferred_location_iterations: Frontier points compared by
+//       LocationChoice::Preferred.
+//   field_threads, map_directory: Used to compute and hold the
+//       PreferenceChoice::PerlinField.
+void SetChosenGenerators(GrowthImage& g, LocationChoice location_choice,
+                         PreferenceChoice preference_choice,
+                         int preferred_location_iterations,
+                         double perlin_grid_size, int perlin_octaves,
+                         int field_threads, const std::string& map_directory);
+
+#endif /* _GENERATORCHOICES_H_ */
@@ -0,0 +1,68 @@
+#ifndef _GRIDPALETTE_H_
+#define _GRIDPALETTE_H_
+
+#include <vector>
+
+#include "Color.hh"
+#include "KDTree.hh"
+#include "PaletteEngine.hh"
+
+// Palette engine for palettes that fill a large part of the RGB cube.
+//
+// Holds a pyramid of occupancy counts.  Level 0 has the number of
+// remaining copies of every 24-bit color, and each level above merges
+// 2x2x2 blocks of the level below, up to a single count for the whole
+// cube.  Each level is stored in Morton order, so the eight children
+// of a block are adjacent in memory.  A search descends from the top, visiting the closest blocks
+// first and skipping any that are empty or too far away.  The depth is
+// fixed, so the cost of a search hardly depends on the palette size.
+class GridPalette : public PaletteEngine{
+public:
+  // Throws if any color is given more than 255 times.
+  GridPalette(const std::vector<Color>& colors);
+  GridPalette(CheckpointReader& reader);
+
+  // Whether the palette is dense enough to be worth using a
+  // GridPalette, and can be represented by one.
+  static bool IsSuitable(const std::vector<Color>& colors);
+
+  virtual KDTree_Result<Color> PopClosest(Color query, double epsilon);
+  virtual KDTree_Result<Color> GetClosest(Color query, double epsilon);
+  // A color found is popped directly from its count, if any remain.
+  virtual void FindClosest(const Color* queries, size_t n, double epsilon,
+                           KDTree_Found<Color>* output);
+  virtual KDTree_Result<Color> PopFound(const KDTree_Found<Color>& found,
+                                        Color query, double epsilon);
+  virtual int GetNumLeaves();
+  virtual void Save(CheckpointWriter& writer) const;
+  virtual size_t MemoryUsage() const;
+
+  // Morton index of a color at level 0.  The block containing it at
+  // level n is at index (MortonIndex(col) >> 3*n).
+  static size_t MortonIndex(Color col);
+
+private:
+  enum {num_levels = 9};
+
+  struct SearchRes{
+    int dist2;
+    int r, g, b;
+  };
+
+  // Fills in every level above level 0 from the color counts.
+  void build_blocks();
+
+  unsigned int count(int level, size_t index) const;
+  // Removes one of the color at the Morton index, which must remain.
+  void remove(size_t index);
+
+  void search(int level, size_t index, int x, int y, int z, Color query,
+              double epsilon_factor, SearchRes& best, PerformanceStats& stats) const;
+
+  // Remaining copies of each color.
+  std::vector<unsigned char> colors;
+  // Remaining colors in each block, for levels 1 through num_levels-1.
+  std::vector<std::vector<unsigned int> > blocks;
+};
+
+#endif /* _GRIDPALETTE_H_ */
@@ -3,17 +3,27 @@
 
 #include <vector>
 #include <list>
+#include <chrono>
 #include <cmath>
+#include <random>
+#include <stdexcept>
 #include <string>
 #include <unordered_set>
 #include <functional>
+#include <memory>
 
+#include "Checkpoint.hh"
+#include "ImageBuffer.hh"
 #include "PerlinNoise.hh"
 #include "Point.hh"
 #include "PointTracker.hh"
+#include "SavePNG.hh"
 #include "SmartEnum.hh"
+#include "StatsBuffer.hh"
+#include "ThreadPool.hh"
 #include "UniquePalette.hh"
 #include "KDTree.hh"
+#include "NeighborColors.hh"
 
 namespace Lua{
   class LuaState;
@@ -22,9 +32,70 @@ namespace Lua{
 typedef std::function<int(int,int)> RandomInt;
 typedef std::function<std::vector<Color>(RandomInt,int)> PaletteGenerator;
 typedef std::function<std::vector<Point>(RandomInt,int,int)> InitialLocationGenerator;
-typedef std::function<Point(RandomInt,const PointTracker&)> LocationGenerator;
-typedef std::function<double(RandomInt,Point,const PointTracker&)> PreferenceGenerator;
-typedef std::function<Color(RandomInt,std::vector<Color>,Point)> TargetColorGenerator;
+// Called for every pixel, so the random number generator and the
+// neighboring colors are passed by reference.
+typedef std::function<Point(RandomInt&,const PointTracker&)> LocationGenerator;
+typedef std::function<double(RandomInt&,Point,const PointTracker&)> PreferenceGenerator;
+typedef std::function<Color(RandomInt&,const NeighborColors&,Point)> TargetColorGenerator;
+// Called once for several pixels, returning one result for each
+// point given, so that a lua function is entered once per batch.
+typedef std::function<std::vector<double>(RandomInt&,const std::vector<Point>&,
+                                          const PointTracker&)> PreferenceBatchGenerator;
+typedef std::function<std::vector<Color>(RandomInt&,const std::vector<NeighborColors>&,
+                                         const std::vector<Point>&)> TargetColorBatchGenerator;
+
+class GrowthImage;
+
+// Seconds spent in each step of filling pixels, and the number of
+// pixels filled, while phase timing is enabled.
+struct PhaseTimes{
+  PhaseTimes()
+    : location(0), target_color(0), palette(0), fill(0), pixels(0) { }
+
+  double location;
+  double target_color;
+  double palette;
+  // Includes finding the preferences of the new frontier points.
+  double fill;
+  size_t pixels;
+};
+
+// A set of location, preference, and target color generators, held
+// with their exact types.
+class CompiledGenerators{
+public:
+  virtual ~CompiledGenerators() { }
+  virtual bool Iterate(GrowthImage& g) = 0;
+
+  // Saves and restores any state held by the generators.
+  virtual void SaveState(CheckpointWriter& writer) const = 0;
+  virtual void LoadState(CheckpointReader& reader) = 0;
+};
+
+template<typename Location, typename Preference, typename TargetColor>
+class CompiledGeneratorsImpl : public CompiledGenerators{
+public:
+  CompiledGeneratorsImpl(Location location, Preference preference, TargetColor target_color)
+    : location(location), preference(preference), target_color(target_color) { }
+
+  virtual bool Iterate(GrowthImage& g);
+
+  virtual void SaveState(CheckpointWriter& writer) const {
+    SaveGeneratorState(writer, location);
+    SaveGeneratorState(writer, preference);
+    SaveGeneratorState(writer, target_color);
+  }
+  virtual void LoadState(CheckpointReader& reader){
+    LoadGeneratorState(reader, location);
+    LoadGeneratorState(reader, preference);
+    LoadGeneratorState(reader, target_color);
+  }
+
+private:
+  Location location;
+  Preference preference;
+  TargetColor target_color;
+};
 
 class GrowthImage{
 public:
@@ -39,20 +110,138 @@ public:
   void SetPreferenceGenerator(PreferenceGenerator func);
   void SetTargetColorGenerator(TargetColorGenerator func);
 
+  // If set, used instead of the preference or target color generator,
+  // compiled or not.  The preferences of the points around all pixels
+  // filled by an iteration are found together, with one call, before
+  // any of them is added to the frontier.  The target colors of a whole batch are found together,
+  // so any image with a batch target color generator is filled in
+  // batches, even with a batch size of 1.
+  void SetPreferenceBatchGenerator(PreferenceBatchGenerator func);
+  void SetTargetColorBatchGenerator(TargetColorBatchGenerator func);
+
+  // Replaces the location, preference, and target color generators.
+  // Unlike the std::function generators above, the types are known
+  // when compiling, and so the calls made for each pixel can be inlined.
+  template<typename Location, typename Preference, typename TargetColor>
+  void SetCompiledGenerators(Location location, Preference preference, TargetColor target_color){
+    compiled_generators = std::unique_ptr<CompiledGenerators>(
+      new CompiledGeneratorsImpl<Location,Preference,TargetColor>(
+        location, preference, target_color));
+  }
+
+  // Names of the generators given, saved in checkpoints so that a
+  // checkpoint is only resumed with the same generators.  Set by
+  // SetChosenGenerators().
+  void SetGeneratorNames(const std::string& location, const std::string& preference);
+
   void Seed(int seed);
 
   void SetPerlinOctaves(int octaves);
   void SetPerlinGridSize(double grid_size);
 
+  // Ordering of the frontier passed to the location generator.
+  void SetFrontierOrder(FrontierOrder order);
+
+  // When the preference generator is called.  Defaults to
+  // PreferencePolicy::EveryNeighbor, which calls it most often, but is
+  // needed to reproduce images from generators that use the random
+  // numbers.
+  void SetPreferencePolicy(PreferencePolicy policy);
+
   void SetEpsilon(double epsilon);
+  void SetPaletteBackend(PaletteBackend backend);
+
+  // Number of pixels chosen and filled by each call to Iterate().
+  // Pixels in the same batch are never adjacent to each other.
+  void SetBatchSize(int batch_size);
+
+  // Number of threads used to find colors for a batch.  Has no effect
+  // unless the batch size is above 1, or for images configured from a
+  // lua script.  With the same seed and batch size, results are
+  // identical for any number of threads above 1, but may differ from a
+  // single thread, which pops each target of a batch in turn rather
+  // than searching for all of them first.  With the Concurrent palette
+  // backend, results are not deterministic for more than one thread.
+  void SetThreads(int threads);
+
+  // Number of threads used to build the palette.  The palette built
+  // does not depend on the number of threads.
+  void SetBuildThreads(int threads);
+
+  // Builds a FlatTree palette lazily, as each part is first searched,
+  // so that growth starts right away.  Does not change the image
+  // compared to a FlatTree palette.  Requires the FlatTree or Auto
+  // palette backend.  With more than one thread and a batch size above
+  // 1, the first batch builds the rest of the tree in full, on a single
+  // thread, so there is little to gain.
+  void SetLazyPalette(bool lazy);
+
+  // Times each step of every iteration from now on, for
+  // GetPhaseTimes().  Building the palette is not included, and is
+  // given by GetPalette().GetBuildSeconds() instead.
+  void SetPhaseTiming(bool enabled);
+  const PhaseTimes& GetPhaseTimes() const { return phase_times; }
+
+  const UniquePalette& GetPalette() const { return palette; }
+
+  // How much of the search statistics to keep for SaveStats().
+  // Defaults to StatsMode::Full.  Must be called before the first
+  // iteration.
+  void SetStatsMode(StatsMode mode);
+
+  // Holds the pixels, stats, and state of each pixel in mapped files
+  // in the directory given, so that images larger than memory can be
+  // grown.  An empty directory holds them in memory, the default.
+  // Must be called before the first iteration.
+  void SetMapDirectory(const std::string& directory);
 
   void Reset();
   bool Iterate();
   void IterateUntilDone();
 
+  // Writes the full state of a growth in progress.  Loading it into
+  // an image set up with the same options continues the growth
+  // exactly as if it had not been interrupted.  State held within
+  // generators is only saved for compiled generators, and images
+  // configured from a lua script cannot be saved.  Loading throws if
+  // the generator names, preference policy, batch size, epsilon,
+  // palette backend, whether batches use a thread pool, or seed differ
+  // from the checkpoint, unless no seed was given.
+  void SaveCheckpoint(const std::string& filename);
+  void LoadCheckpoint(const std::string& filename);
+
+  // Makes IterateUntilDone() save a checkpoint each time another
+  // `every` pixels have been filled.  Disabled if `every` is 0.
+  void SetCheckpointing(const std::string& filename, int every);
+
+  // Performs one iteration, using the generators given instead of
+  // those held by the image.
+  template<typename Location, typename Preference, typename TargetColor>
+  bool IterateWith(Location& location, Preference& preference, TargetColor& target_color);
+
+  void SetPNGOptions(const PNGOptions& options);
   void Save(const std::string& filepath);
   void SaveStats(const std::string& filepath);
 
+  // The pixels in row order.  Not available if the image is held in
+  // mapped files.
+  const std::vector<Color>& GetPixels() const;
+
+  // The image is divided into square tiles of this size, numbered
+  // across each row of tiles.
+  static const int tile_size = 16;
+
+  // Whether to record which tiles are changed by each pixel filled.
+  // Off by default, so that only runs recording a delta log pay for
+  // it.
+  void SetTrackChangedTiles(bool enabled);
+
+  // Tiles with a pixel filled since the last call to
+  // ClearChangedTiles(), in the order they were first changed.  Empty
+  // unless SetTrackChangedTiles() is enabled.
+  const std::vector<int>& GetChangedTiles() const { return changed_tiles; }
+  void ClearChangedTiles();
+
   int GetWidth();
   int GetHeight();
 
@@ -62,13 +251,66 @@ public:
 
 private:
   void FirstIteration();
+  void allocate_buffers();
+
+  template<typename Location, typename Preference, typename TargetColor>
+  void IterateBatch(Location& location, Preference& preference, TargetColor& target_color);
+  // Sets batch_targets for batch_locations, one location at a time.
+  template<typename TargetColor>
+  void FindTargets(TargetColor& target_color, ThreadPool* pool);
 
-  Point ChooseLocation();
-  KDTree_Result<Color> ChooseColor(Point loc);
+  template<typename Location>
+  void ChooseLocations(int n, std::vector<Point>& locations, Location& location);
+  void ClaimLocation(Point loc, int n, std::vector<Point>& locations);
+  template<typename TargetColor>
+  Color ChooseTargetColor(Point loc, RandomInt& rand, TargetColor& target_color);
+  NeighborColors FilledNeighbors(Point loc);
+  template<typename Preference>
+  void FillPixel(Point loc, const KDTree_Result<Color>& res, Preference& preference);
+  // Sets the color of a pixel, without updating the point tracker.
+  void SetPixel(Point loc, const KDTree_Result<Color>& res){
+    auto index = get_index(loc);
+    pixels[index] = res.res;
+    stats.Set(index, res.stats);
+    num_filled++;
+
+    if(track_changed_tiles){
+      int tiles_across = (width + tile_size - 1)/tile_size;
+      int tile = (loc.j/tile_size)*tiles_across + loc.i/tile_size;
+      if(!tile_changed[tile]){
+        tile_changed[tile] = true;
+        changed_tiles.push_back(tile);
+      }
+    }
+  }
+  // Callable for PointTracker::FillBatch(), which sets the preferences
+  // from the batch preference generator.
+  std::function<void(std::vector<Point>&)> batch_preferences();
+
+  // Adds the time since the last call to the phase given, if phase
+  // timing is enabled.
+  void lap(double& phase){
+    if(phase_timing){
+      auto now = std::chrono::steady_clock::now();
+      phase += std::chrono::duration<double>(now - last_lap).count();
+      last_lap = now;
+    }
+  }
 
 private:
-  size_t get_index(int i, int j);
-  size_t get_index(Point p);
+  size_t get_index(int i, int j){
+    if ( i>=0 && i<width &&
+         j>=0 && j<height ) {
+      return pixels.Index(i, j);
+    } else {
+      return -1;
+    }
+  }
+  size_t get_index(Point p){
+    return get_index(p.i, p.j);
+  }
+
+  enum BatchClaim : unsigned char { unclaimed = 0, in_batch, deferred };
 
   Lua::LuaState* state;
 
@@ -77,20 +319,228 @@ private:
   LocationGenerator location_generator;
   PreferenceGenerator preference_generator;
   TargetColorGenerator target_color_generator;
+  PreferenceBatchGenerator preference_batch_generator;
+  TargetColorBatchGenerator target_color_batch_generator;
+  std::unique_ptr<CompiledGenerators> compiled_generators;
+
+  std::string location_name;
+  std::string preference_name;
 
   PointTracker point_tracker;
+  PreferencePolicy preference_policy;
 
   double epsilon;
+  int batch_size;
 
   UniquePalette palette;
 
   int width;
   int height;
-  std::vector<Color> pixels;
-  std::vector<PerformanceStats> stats;
+  std::string map_directory;
+  ImageBuffer<Color> pixels;
+  StatsBuffer stats;
+  int num_filled;
+
+  std::vector<Point> batch_locations;
+  std::vector<Color> batch_targets;
+  std::vector<NeighborColors> batch_neighbors;
+  // Locations skipped in the last batch for being next to another
+  // location in it, to be used first in the next batch.
+  std::vector<Point> deferred_locations;
+  // Per-pixel marker of locations in the current batch or deferred.
+  std::vector<unsigned char> batch_claims;
+
+  std::unique_ptr<ThreadPool> thread_pool;
+
+  PNGOptions png_options;
+
+  std::string checkpoint_filename;
+  int checkpoint_every;
+
+  bool phase_timing;
+  PhaseTimes phase_times;
+  std::chrono::steady_clock::time_point last_lap;
 
+  bool track_changed_tiles;
+  std::vector<int> changed_tiles;
+  // Per-tile marker of tiles in changed_tiles.
+  std::vector<unsigned char> tile_changed;
+
+  // The seed used, and whether it was taken from the time.
+  int seed;
+  bool seed_from_time;
   std::mt19937 rng;
   RandomInt rand_int;
 };
 
+template<typename Location, typename Preference, typename TargetColor>
+bool CompiledGeneratorsImpl<Location,Preference,TargetColor>::Iterate(GrowthImage& g){
+  return g.IterateWith(location, preference, target_color);
+}
+
+template<typename Location, typename Preference, typename TargetColor>
+bool GrowthImage::IterateWith(Location& location, Preference& preference, TargetColor& target_color){
+  if(!palette.ColorsRemaining()){
+    palette.SetPalette(palette_generator(rand_int, GetWidth() * GetHeight()));
+  }
+  if(!point_tracker.FrontierSize()){
+    FirstIteration();
+  }
+  if(phase_timing){
+    last_lap = std::chrono::steady_clock::now();
+  }
+
+  if(batch_size > 1 || target_color_batch_generator){
+    IterateBatch(location, preference, target_color);
+  } else {
+    auto loc = location(rand_int, point_tracker);
+    lap(phase_times.location);
+    auto target = ChooseTargetColor(loc, rand_int, target_color);
+    lap(phase_times.target_color);
+    auto res = palette.PopClosest(target, epsilon);
+    lap(phase_times.palette);
+    FillPixel(loc, res, preference);
+    lap(phase_times.fill);
+    phase_times.pixels++;
+  }
+
+  return point_tracker.FrontierSize();
+}
+
+template<typename Location, typename Preference, typename TargetColor>
+void GrowthImage::IterateBatch(Location& location, Preference& preference, TargetColor& target_color){
+  ChooseLocations(std::min(batch_size, palette.ColorsRemaining()), batch_locations, location);
+  lap(phase_times.location);
+
+  // Lua functions cannot be called from other threads.
+  ThreadPool* pool = state ? nullptr : thread_pool.get();
+
+  if(target_color_batch_generator){
+    batch_neighbors.clear();
+    for(auto loc : batch_locations){
+      batch_neighbors.push_back(FilledNeighbors(loc));
+    }
+    batch_targets = target_color_batch_generator(rand_int, batch_neighbors, batch_locations);
+    if(batch_targets.size() != batch_locations.size()){
+      throw std::runtime_error("Batch target color generator returned the wrong number of colors");
+    }
+  } else {
+    FindTargets(target_color, pool);
+  }
+  lap(phase_times.target_color);
+
+  auto results = palette.PopClosestBatch(batch_targets, epsilon, pool);
+  lap(phase_times.palette);
+  if(preference_batch_generator){
+    // One call finds the preferences around every pixel of the batch.
+    for(size_t i=0; i<batch_locations.size(); i++){
+      SetPixel(batch_locations[i], results[i]);
+    }
+    point_tracker.FillBatch(batch_locations, batch_preferences(), preference_policy);
+  } else {
+    for(size_t i=0; i<batch_locations.size(); i++){
+      FillPixel(batch_locations[i], results[i], preference);
+    }
+  }
+  lap(phase_times.fill);
+  phase_times.pixels += batch_locations.size();
+}
+
+template<typename TargetColor>
+void GrowthImage::FindTargets(TargetColor& target_color, ThreadPool* pool){
+  // Each location gets its own random number generator, so that the
+  // results do not depend on which thread handles it.
+  unsigned int batch_seed = rng();
+  batch_targets.resize(batch_locations.size());
+  auto find_target = [&](size_t i){
+    std::minstd_rand location_rng(batch_seed + i);
+    RandomInt location_rand = [&location_rng](int a, int b){
+      if(a >= b){
+        throw std::runtime_error("Improper range for random numbers");
+      }
+      return std::uniform_int_distribution<int>(a,b-1)(location_rng);
+    };
+    batch_targets[i] = ChooseTargetColor(batch_locations[i], location_rand, target_color);
+  };
+
+  if(pool){
+    pool->ParallelFor(batch_locations.size(), find_target);
+  } else {
+    for(size_t i=0; i<batch_locations.size(); i++){
+      find_target(i);
+    }
+  }
+}
+
+template<typename Preference>
+void GrowthImage::FillPixel(Point loc, const KDTree_Result<Color>& res, Preference& preference){
+  SetPixel(loc, res);
+
+  if(preference_batch_generator){
+    point_tracker.FillBatch({loc}, batch_preferences(), preference_policy);
+  } else {
+    point_tracker.Fill(
+      loc,
+      [&](Point pos) {
+        return preference(rand_int, pos, point_tracker);
+      },
+      preference_policy);
+  }
+}
+
+template<typename Location>
+void GrowthImage::ChooseLocations(int n, std::vector<Point>& locations, Location& location){
+  locations.clear();
+  if(batch_claims.size() != pixels.size()){
+    batch_claims.assign(pixels.size(), unclaimed);
+  }
+
+  std::vector<Point> previous;
+  previous.swap(deferred_locations);
+  for(auto loc : previous){
+    batch_claims[get_index(loc)] = unclaimed;
+    ClaimLocation(loc, n, locations);
+  }
+
+  // The location generator does not know about points chosen earlier
+  // in the batch, and may return them again.  Give up on filling the
+  // batch after too many repeats, such as when the frontier is small.
+  int max_attempts = 2*n;
+  for(int attempt=0; attempt<max_attempts && int(locations.size())<n; attempt++){
+    Point loc = location(rand_int, point_tracker);
+    if(get_index(loc) == size_t(-1)){
+      // Past the end of a sequential fill.
+      break;
+    }
+    ClaimLocation(loc, n, locations);
+  }
+
+  for(auto loc : locations){
+    batch_claims[get_index(loc)] = unclaimed;
+  }
+}
+
+template<typename TargetColor>
+Color GrowthImage::ChooseTargetColor(Point loc, RandomInt& rand, TargetColor& target_color){
+  return target_color(rand, FilledNeighbors(loc), loc);
+}
+
+inline NeighborColors GrowthImage::FilledNeighbors(Point loc){
+  NeighborColors neighbors;
+  for(int di=-1; di<=1; di++){
+    for(int dj=-1; dj<=1; dj++){
+      if(di==0 && dj==0){
+        continue;
+      }
+      Point p(loc.i+di,loc.j+dj);
+      auto index = get_index(p);
+      if((index!=size_t(-1)) &&
+         point_tracker.IsFilled(p.i,p.j)){
+        neighbors.push_back(pixels[index]);
+      }
+    }
+  }
+  return neighbors;
+}
+
 #endif /* _GROWTHIMAGE_H_ */
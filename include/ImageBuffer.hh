@@ -0,0 +1,161 @@
+#ifndef _IMAGEBUFFER_H_
+#define _IMAGEBUFFER_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// Zero-filled memory backed by a temporary file, which is removed as
+// soon as it has been mapped.  Pages are written back to the file
+// under memory pressure instead of being kept resident.
+class MappedFile{
+public:
+  MappedFile(const std::string& directory, size_t bytes);
+  ~MappedFile();
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  void* GetData() const { return data; }
+  size_t GetSize() const { return bytes; }
+
+private:
+  void* data;
+  size_t bytes;
+};
+
+// One value for every pixel of an image.
+//
+// Held in memory, values are stored row by row.  Held in a mapped
+// file, the image is split into square tiles, each stored
+// contiguously, so that the pixels around any point of the growth
+// front share a few pages.  Index(i,j) gives the position of a pixel
+// in either layout.  The tiled layout pads the image out to a whole
+// number of tiles, so size() can be larger than width*height.
+template<typename T>
+class ImageBuffer{
+public:
+  static_assert(std::is_trivially_copyable<T>::value,
+                "ImageBuffer values are copied as raw bytes");
+
+  // Log2 of the tile size used by mapped buffers.
+  static const int tile_bits = 6;
+
+  ImageBuffer()
+    : width(0), height(0), tiled(false), tiles_across(0), num_values(0), values(nullptr) { }
+
+  // If map_directory is empty, the values are held in memory.
+  // Otherwise, they are held in a file created in that directory.
+  ImageBuffer(int width, int height, T initial = T(),
+              const std::string& map_directory = "")
+    : width(width), height(height), tiled(!map_directory.empty()),
+      map_directory(map_directory) {
+    if(tiled){
+      tiles_across = (width + (1<<tile_bits) - 1) >> tile_bits;
+      int tiles_down = (height + (1<<tile_bits) - 1) >> tile_bits;
+      num_values = size_t(tiles_across)*tiles_down << 2*tile_bits;
+      mapped.reset(new MappedFile(map_directory, std::max<size_t>(num_values,1)*sizeof(T)));
+      values = static_cast<T*>(mapped->GetData());
+
+      // The file starts out zeroed, so there is no need to touch
+      // every page unless some other value is wanted.
+      const char zero[sizeof(T)] = {};
+      if(std::memcmp(&initial, zero, sizeof(T))){
+        std::fill(values, values + num_values, initial);
+      }
+    } else {
+      tiles_across = 0;
+      num_values = size_t(width)*height;
+      memory.assign(num_values, initial);
+      values = memory.data();
+    }
+  }
+
+  ImageBuffer(const ImageBuffer& other)
+    : ImageBuffer(other.width, other.height, T(), other.map_directory) {
+    std::copy(other.values, other.values + num_values, values);
+  }
+
+  ImageBuffer(ImageBuffer&& other) = default;
+
+  ImageBuffer& operator=(ImageBuffer other){
+    swap(other);
+    return *this;
+  }
+
+  void swap(ImageBuffer& other){
+    std::swap(width, other.width);
+    std::swap(height, other.height);
+    std::swap(tiled, other.tiled);
+    std::swap(tiles_across, other.tiles_across);
+    std::swap(num_values, other.num_values);
+    std::swap(map_directory, other.map_directory);
+    memory.swap(other.memory);
+    mapped.swap(other.mapped);
+    std::swap(values, other.values);
+  }
+
+  size_t Index(int i, int j) const {
+    if(tiled){
+      const int mask = (1<<tile_bits) - 1;
+      size_t tile = size_t(j>>tile_bits)*tiles_across + (i>>tile_bits);
+      return (tile << 2*tile_bits) | ((j&mask) << tile_bits) | (i&mask);
+    } else {
+      return size_t(j)*width + i;
+    }
+  }
+
+  T& operator[](size_t index) { return values[index]; }
+  const T& operator[](size_t index) const { return values[index]; }
+
+  T& operator()(int i, int j) { return values[Index(i,j)]; }
+  const T& operator()(int i, int j) const { return values[Index(i,j)]; }
+
+  // Returns the values of row j, in order.  If the row is not stored
+  // contiguously, it is copied into buffer, which must hold width
+  // values.
+  const T* Row(int j, T* buffer) const {
+    if(!tiled){
+      return values + size_t(j)*width;
+    }
+    for(int i=0; i<width; i += 1<<tile_bits){
+      int n = std::min(1<<tile_bits, width-i);
+      std::copy(values + Index(i,j), values + Index(i,j) + n, buffer + i);
+    }
+    return buffer;
+  }
+
+  void Fill(T value){
+    std::fill(values, values + num_values, value);
+  }
+
+  size_t size() const { return num_values; }
+  T* data() { return values; }
+  const T* data() const { return values; }
+
+  int GetWidth() const { return width; }
+  int GetHeight() const { return height; }
+  bool IsMapped() const { return tiled; }
+
+  // The values in row order.  Only available for buffers held in
+  // memory.
+  const std::vector<T>& GetMemory() const { return memory; }
+
+private:
+  int width;
+  int height;
+  bool tiled;
+  int tiles_across;
+  size_t num_values;
+  std::string map_directory;
+
+  std::vector<T> memory;
+  std::unique_ptr<MappedFile> mapped;
+  T* values;
+};
+
+#endif /* _IMAGEBUFFER_H_ */
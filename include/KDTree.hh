@@ -2,15 +2,25 @@
 #define _KDTREE_H_
 
 #include <algorithm> // for std::sort
+#include <atomic>
 #include <cassert>
 #include <cfloat> // for DBL_MAX
 #include <cmath> // for std::abs
 #include <cstddef> // for size_t
+#include <cstdint> // for uint64_t
+#include <cstring> // for std::memcpy
+#include <functional>
 #include <memory> // for std::shared_ptr
+#include <utility> // for std::pair
 #include <vector>
 
 #include <iostream>
 
+#include "Checkpoint.hh"
+#include "Color.hh"
+#include "ColorScan.hh"
+#include "ThreadPool.hh"
+
 struct PerformanceStats {
   unsigned int nodes_checked;
   unsigned int leaf_nodes_checked;
@@ -19,8 +29,27 @@ struct PerformanceStats {
   PerformanceStats() :
     nodes_checked(0), leaf_nodes_checked(0), points_checked(0)
     { }
+
+  PerformanceStats& operator+=(const PerformanceStats& other){
+    nodes_checked += other.nodes_checked;
+    leaf_nodes_checked += other.leaf_nodes_checked;
+    points_checked += other.points_checked;
+    return *this;
+  }
 };
 
+// Trees are rebuilt from their remaining values once fewer than this
+// fraction of the values they were built from remain.  Otherwise, late
+// searches must visit many nearly-empty leaves.
+const double kdtree_rebuild_fraction = 0.25;
+
+// Ranges with fewer values than this become leaf nodes.
+const size_t kdtree_leaf_size = 50;
+
+// Ranges with fewer values than this are partitioned by a single
+// thread when building in parallel.
+const size_t kdtree_parallel_size = 1<<16;
+
 template<typename T>
 class LeafNode;
 
@@ -36,12 +65,307 @@ double distance2(const T& a, const T& b){
   return output;
 }
 
+// The values held by leaf nodes.  Finding the closest value in a leaf
+// is the innermost loop of every search, so this is specialized for
+// Color below.
+template<typename T>
+class LeafValues{
+public:
+  LeafValues(std::vector<T> p_values)
+    : values(std::move(p_values)) { }
+
+  LeafValues(CheckpointReader& reader)
+    : values(reader.ReadVector<T>()) { }
+
+  void Save(CheckpointWriter& writer) const {
+    writer.WriteVector(values);
+  }
+
+  size_t size() const { return values.size(); }
+  T Get(size_t index) const { return values[index]; }
+  void Set(size_t index, T value){ values[index] = value; }
+  void Swap(size_t a, size_t b){ std::swap(values[a], values[b]); }
+
+  // Returns the squared distance and index of the closest value in [begin,end).
+  std::pair<double,size_t> Closest(T query, size_t begin, size_t end) const {
+    double best_distance2 = DBL_MAX;
+    size_t best_index = begin;
+    for(size_t i=begin; i<end; i++){
+      double dist2 = distance2(values[i],query);
+      if(dist2 < best_distance2){
+        best_distance2 = dist2;
+        best_index = i;
+      }
+    }
+    return {best_distance2, best_index};
+  }
+
+  // As above, but skips values where used[i-begin] is nonzero.
+  std::pair<double,size_t> Closest(T query, size_t begin, size_t end,
+                                   const unsigned char* used) const {
+    double best_distance2 = DBL_MAX;
+    size_t best_index = begin;
+    for(size_t i=begin; i<end; i++){
+      if(used[i-begin]){
+        continue;
+      }
+      double dist2 = distance2(values[i],query);
+      if(dist2 < best_distance2){
+        best_distance2 = dist2;
+        best_index = i;
+      }
+    }
+    return {best_distance2, best_index};
+  }
+
+  size_t MemoryUsage() const { return values.capacity()*sizeof(T); }
+
+private:
+  std::vector<T> values;
+};
+
+// Colors are stored as separate r/g/b arrays, so that the vectorized
+// ClosestColor can compare several colors per instruction.
+template<>
+class LeafValues<Color>{
+public:
+  LeafValues(const std::vector<Color>& values) {
+    r.reserve(values.size());
+    g.reserve(values.size());
+    b.reserve(values.size());
+    for(auto col : values){
+      r.push_back(col.r);
+      g.push_back(col.g);
+      b.push_back(col.b);
+    }
+  }
+
+  LeafValues(CheckpointReader& reader)
+    : r(reader.ReadVector<unsigned char>()),
+      g(reader.ReadVector<unsigned char>()),
+      b(reader.ReadVector<unsigned char>()) {
+    if(g.size() != r.size() || b.size() != r.size()){
+      throw std::runtime_error("Invalid colors in checkpoint");
+    }
+  }
+
+  void Save(CheckpointWriter& writer) const {
+    writer.WriteVector(r);
+    writer.WriteVector(g);
+    writer.WriteVector(b);
+  }
+
+  size_t size() const { return r.size(); }
+  size_t MemoryUsage() const { return r.capacity() + g.capacity() + b.capacity(); }
+  Color Get(size_t index) const { return {r[index], g[index], b[index]}; }
+  void Set(size_t index, Color col){
+    r[index] = col.r;
+    g[index] = col.g;
+    b[index] = col.b;
+  }
+  void Swap(size_t x, size_t y){
+    std::swap(r[x], r[y]);
+    std::swap(g[x], g[y]);
+    std::swap(b[x], b[y]);
+  }
+
+  std::pair<double,size_t> Closest(Color query, size_t begin, size_t end,
+                                   const unsigned char* used = nullptr) const {
+    auto res = ClosestColor(r.data()+begin, g.data()+begin, b.data()+begin,
+                            used, end-begin, query);
+    if(res.dist2 == INT_MAX){
+      return {DBL_MAX, begin};
+    }
+    return {res.dist2, begin + res.index};
+  }
+
+private:
+  std::vector<unsigned char> r;
+  std::vector<unsigned char> g;
+  std::vector<unsigned char> b;
+};
+
+// Partitions arr[0,n) about the median value of one dimension, so
+// that values in the first part are less than the median.  Starts
+// with start_dim, moving on to the next dimension if every value is
+// equal in it.  Returns the size of the first part and sets
+// "dimension", or returns 0 if all values are equal.
+template<typename T>
+size_t kdtree_split(T* arr, size_t n, int start_dim, int& dimension){
+  // Loop over each dimension in case all values are equal in one dimension.
+  for(int dim_mod = 0; dim_mod<T::dimensions; dim_mod++){
+    int dim = (start_dim + dim_mod) % T::dimensions;
+
+    // Find the median value.
+    std::nth_element(arr, arr+n/2, arr+n,
+                     [dim](T a, T b){return a.get(dim) < b.get(dim);});
+    double median_value = arr[n/2].get(dim);
+
+    // Find the median index
+    T* median = std::partition(arr, arr+n,
+                               [dim, median_value](T a){
+                                 return a.get(dim) < median_value;
+                               });
+    size_t median_index = median - arr;
+
+    // Will be true so long as the coordinate is not equal for everything in this dimension.
+    if(median_index != 0 && median_index != n){
+      dimension = dim;
+      return median_index;
+    }
+  }
+
+  return 0;
+}
+
+// How a node of a KD-tree splits its range of values.
+struct KDTreeSplit{
+  // Size of the first part, or 0 for a leaf node.
+  size_t median_index;
+  int dimension;
+  // Value at the start of the second part, along the dimension.
+  double median;
+};
+
+// Partitions arr[0,n) as when building a KD-tree, so that the values
+// of each leaf are contiguous.  Appends the split of every node, in
+// pre-order.
+template<typename T>
+void kdtree_partition(T* arr, size_t n, int start_dim, std::vector<KDTreeSplit>& splits){
+  assert(n>0);
+  int dimension = 0;
+  size_t median_index = (n < kdtree_leaf_size) ? 0 : kdtree_split(arr, n, start_dim, dimension);
+  double median = median_index ? double(arr[median_index].get(dimension)) : 0;
+  splits.push_back({median_index, dimension, median});
+  if(median_index){
+    int next_dim = (dimension+1) % T::dimensions;
+    kdtree_partition(arr, median_index, next_dim, splits);
+    kdtree_partition(arr+median_index, n-median_index, next_dim, splits);
+  }
+}
+
+// Same as above, starting from dimension 0, but spread across the
+// threads of the pool, if given.  Each range is partitioned exactly
+// as by a single thread, so the result does not depend on the number
+// of threads.
+template<typename T>
+std::vector<KDTreeSplit> kdtree_partition(T* arr, size_t n, ThreadPool* pool){
+  std::vector<KDTreeSplit> splits;
+  if(!pool || pool->GetNumThreads() <= 1 || n < 2*kdtree_parallel_size){
+    kdtree_partition(arr, n, 0, splits);
+    return splits;
+  }
+
+  struct Range{
+    size_t begin;
+    size_t n;
+    int start_dim;
+    KDTreeSplit split;
+    // Index in ranges of the two parts, if split.
+    size_t left;
+    size_t right;
+    // Partitioned as a whole, with the splits of every node within.
+    bool whole;
+    std::vector<KDTreeSplit> splits;
+  };
+
+  // The top of the tree is split one level at a time, each range of
+  // a level on its own thread, until there are enough ranges to keep
+  // every thread busy.  The remaining ranges are then partitioned
+  // whole.
+  std::vector<Range> ranges(1);
+  ranges[0].begin = 0;
+  ranges[0].n = n;
+  ranges[0].start_dim = 0;
+  std::vector<size_t> level = {0};
+  std::vector<size_t> whole;
+  const size_t enough_ranges = 8*pool->GetNumThreads();
+  while(!level.empty()){
+    std::vector<size_t> to_split;
+    for(size_t index : level){
+      if(ranges[index].n < kdtree_parallel_size || level.size() >= enough_ranges){
+        whole.push_back(index);
+      } else {
+        to_split.push_back(index);
+      }
+    }
+
+    pool->ParallelFor(to_split.size(), [&](size_t k){
+        Range& range = ranges[to_split[k]];
+        range.split.dimension = 0;
+        range.split.median_index = kdtree_split(arr + range.begin, range.n, range.start_dim,
+                                                range.split.dimension);
+        range.split.median = 0;
+        if(range.split.median_index){
+          T* median = arr + range.begin + range.split.median_index;
+          range.split.median = double(median->get(range.split.dimension));
+        }
+      });
+
+    level.clear();
+    for(size_t index : to_split){
+      KDTreeSplit split = ranges[index].split;
+      if(!split.median_index){
+        // Every value is equal.
+        continue;
+      }
+      int next_dim = (split.dimension+1) % T::dimensions;
+      size_t begin = ranges[index].begin;
+      size_t size = ranges[index].n;
+      ranges[index].left = ranges.size();
+      ranges.push_back({begin, split.median_index, next_dim, {0,0,0}, 0, 0, false, {}});
+      ranges[index].right = ranges.size();
+      ranges.push_back({begin + split.median_index, size - split.median_index, next_dim,
+                        {0,0,0}, 0, 0, false, {}});
+      level.push_back(ranges[index].left);
+      level.push_back(ranges[index].right);
+    }
+  }
+
+  pool->ParallelFor(whole.size(), [&](size_t k){
+      Range& range = ranges[whole[k]];
+      range.whole = true;
+      kdtree_partition(arr + range.begin, range.n, range.start_dim, range.splits);
+    });
+
+  std::function<void(size_t)> append = [&](size_t index){
+    Range& range = ranges[index];
+    if(range.whole){
+      splits.insert(splits.end(), range.splits.begin(), range.splits.end());
+      return;
+    }
+    splits.push_back(range.split);
+    if(range.split.median_index){
+      append(range.left);
+      append(range.right);
+    }
+  };
+  append(0);
+  return splits;
+}
+
 template<typename T>
 struct KDTree_Result {
   T res;
   PerformanceStats stats;
 };
 
+// A value found by a search, which the tree searched can pop later
+// without searching again, as long as the value has not been removed
+// in the meantime.
+template<typename T>
+struct KDTree_Found {
+  KDTree_Found() : leaf(-1), index(0), generation(0) { }
+
+  KDTree_Result<T> result;
+  // The node holding the value, or -1 if nothing was found.
+  int64_t leaf;
+  // Position of the value within the tree.
+  size_t index;
+  // Incremented each time the tree is rebuilt, which moves every value.
+  unsigned int generation;
+};
+
 template<typename T>
 class NodeBase{
 public:
@@ -64,6 +388,7 @@ public:
   KDTree_Result<T> PopClosest(T query, double epsilon){
     KDTree_Result<T> output;
     auto res = GetClosestNode(query, epsilon, output.stats);
+    output.res = res.leaf->PopValue(res.index);
     NodeBase<T>* node_ptr = res.leaf;
     while(true){
       node_ptr->ReduceLeaves();
@@ -72,7 +397,6 @@ public:
         break;
       }
     }
-    output.res = res.leaf->PopValue(res.index);
     return output;
   }
 
@@ -86,6 +410,15 @@ public:
   // Mark one leaf as having been finished.
   virtual void ReduceLeaves() = 0;
 
+  // Appends all values that have not yet been popped.
+  virtual void CollectValues(std::vector<T>& output) = 0;
+
+  // Writes this node and its children, to be read by KDTree.
+  virtual void Save(CheckpointWriter& writer) const = 0;
+
+  // Bytes used by this node and its children.
+  virtual size_t MemoryUsage() const = 0;
+
 private:
   // Returns a (distance,leafnode) pair of the closest value.
   virtual SearchRes GetClosestNode(T query, double epsilon,
@@ -100,54 +433,64 @@ template<typename T>
 class LeafNode : public NodeBase<T> {
 public:
   LeafNode(std::vector<T> p_values)
-    : values(std::move(p_values)), used(values.size(),false), leaves_unused(values.size()) {
+    : values(std::move(p_values)), leaves_unused(values.size()) {
     assert(leaves_unused>0);
   }
 
+  LeafNode(CheckpointReader& reader)
+    : values(reader), leaves_unused(reader.Read<int>()) {
+    if(leaves_unused < 0 || size_t(leaves_unused) > values.size()){
+      throw std::runtime_error("Invalid leaf in checkpoint");
+    }
+  }
+
   virtual int GetNumLeaves(){
     return leaves_unused;
   }
   virtual void ReduceLeaves(){
     leaves_unused--;
   }
-  void MarkAsUsed(size_t index){
-    used[index] = true;
+  virtual void CollectValues(std::vector<T>& output){
+    for(int i=0; i<leaves_unused; i++){
+      output.push_back(values.Get(i));
+    }
+  }
+  virtual void Save(CheckpointWriter& writer) const {
+    writer.Write<char>('L');
+    values.Save(writer);
+    writer.Write<int>(leaves_unused);
+  }
+  virtual size_t MemoryUsage() const {
+    return sizeof(*this) + values.MemoryUsage();
   }
 
   T GetValue(size_t index){
-    return values[index];
+    return values.Get(index);
   }
 
+  // Removes a value by swapping it to the end of the unused values.
+  // Must be called before ReduceLeaves().
   T PopValue(size_t index){
-    used[index] = true;
-    return values[index];
+    assert(int(index) < leaves_unused);
+    T output = values.Get(index);
+    values.Swap(index, leaves_unused-1);
+    return output;
   }
 
 private:
   virtual typename NodeBase<T>::SearchRes GetClosestNode(T query, double /* epsilon */, PerformanceStats& stats){
     assert(leaves_unused > 0);
-    assert(values.size() == used.size());
 
     stats.nodes_checked += 1;
     stats.leaf_nodes_checked += 1;
     stats.points_checked += leaves_unused;
 
-    double best_distance2 = DBL_MAX;
-    size_t best_index = 0;
-    for(size_t i=0; i<values.size(); i++){
-      if(!used[i]){
-        double dist2 = distance2(values[i],query);
-        if(dist2 < best_distance2){
-          best_distance2 = dist2;
-          best_index = i;
-        }
-      }
-    }
-    return {best_distance2, this, best_index};
+    auto res = values.Closest(query, 0, leaves_unused);
+    return {res.first, this, res.second};
   }
 
-  std::vector<T> values;
-  std::vector<bool> used;
+  // The first leaves_unused values are those still available.
+  LeafValues<T> values;
   int leaves_unused;
 };
 
@@ -168,6 +511,20 @@ public:
   virtual void ReduceLeaves(){
     num_leaves--;
   }
+  virtual void CollectValues(std::vector<T>& output){
+    left->CollectValues(output);
+    right->CollectValues(output);
+  }
+  virtual void Save(CheckpointWriter& writer) const {
+    writer.Write<char>('I');
+    writer.Write<int>(dimension);
+    writer.Write<double>(median);
+    left->Save(writer);
+    right->Save(writer);
+  }
+  virtual size_t MemoryUsage() const {
+    return sizeof(*this) + left->MemoryUsage() + right->MemoryUsage();
+  }
 private:
   virtual typename NodeBase<T>::SearchRes GetClosestNode(T query, double epsilon, PerformanceStats& stats){
     assert(num_leaves > 0);
@@ -204,12 +561,34 @@ private:
 template<typename T>
 class KDTree{
 public:
-  KDTree(std::vector<T> vec){
-    root = make_node(vec.data(), vec.size());
+  // If a thread pool is given, it is used to build and rebuild the
+  // tree in parallel.
+  KDTree(std::vector<T> vec, std::shared_ptr<ThreadPool> pool = nullptr)
+    : pool(pool) {
+    build(std::move(vec));
+  }
+
+  KDTree(CheckpointReader& reader, std::shared_ptr<ThreadPool> pool = nullptr)
+    : pool(pool) {
+    built_size = reader.Read<uint64_t>();
+    root = load_node(reader);
+  }
+
+  void Save(CheckpointWriter& writer) const {
+    writer.Write<uint64_t>(built_size);
+    root->Save(writer);
   }
 
   KDTree_Result<T> PopClosest(T query, double epsilon = 0){
-    return root->PopClosest(query, epsilon);
+    auto output = root->PopClosest(query, epsilon);
+    int remaining = GetNumLeaves();
+    if(remaining > 0 && remaining < built_size*kdtree_rebuild_fraction){
+      std::vector<T> values;
+      values.reserve(remaining);
+      root->CollectValues(values);
+      build(std::move(values));
+    }
+    return output;
   }
 
   KDTree_Result<T> GetClosest(T query, double epsilon = 0){
@@ -220,49 +599,323 @@ public:
     return root->GetNumLeaves();
   }
 
+  size_t MemoryUsage() const {
+    return root->MemoryUsage();
+  }
+
 private:
-  std::unique_ptr<NodeBase<T> > make_node(T* arr, size_t n, int start_dim = 0){
+  void build(std::vector<T> vec){
+    built_size = vec.size();
+    auto splits = kdtree_partition(vec.data(), vec.size(), pool.get());
+    size_t next_split = 0;
+    root = make_node(vec.data(), vec.size(), splits, next_split);
+  }
+
+  std::unique_ptr<NodeBase<T> > make_node(T* arr, size_t n, const std::vector<KDTreeSplit>& splits,
+                                          size_t& next_split){
     assert(n>0);
-    if(n < 50){
-      std::vector<T> elements = {arr,arr+n};
-      assert(elements.size() > 0);
-      return std::unique_ptr<LeafNode<T> >(new LeafNode<T>(elements));
+    KDTreeSplit split = splits[next_split++];
+    size_t median_index = split.median_index;
+    if(median_index){
+      int dimension = split.dimension;
+      double median = split.median;
+      auto left = make_node(arr, median_index, splits, next_split);
+      auto right = make_node(arr+median_index, n-median_index, splits, next_split);
+      return std::unique_ptr<InternalNode<T> >(new InternalNode<T>(
+                                                 std::move(left), std::move(right),
+                                                 dimension,median));
+    }
+
+    // Either few enough values for a leaf, or every value is equal.
+    std::vector<T> elements(arr,arr+n);
+    return std::unique_ptr<LeafNode<T> >(new LeafNode<T>(elements));
+  }
+
+  std::unique_ptr<NodeBase<T> > load_node(CheckpointReader& reader){
+    char type = reader.Read<char>();
+    if(type == 'L'){
+      return std::unique_ptr<LeafNode<T> >(new LeafNode<T>(reader));
+    } else if(type == 'I'){
+      int dimension = reader.Read<int>();
+      double median = reader.Read<double>();
+      auto left = load_node(reader);
+      auto right = load_node(reader);
+      return std::unique_ptr<InternalNode<T> >(new InternalNode<T>(
+                                                 std::move(left), std::move(right),
+                                                 dimension, median));
     } else {
-      // Loop over each dimension in case all values are equal in one dimension.
-      for(int dim_mod = 0; dim_mod<T::dimensions; dim_mod++){
-        int dimension = (start_dim + dim_mod) % T::dimensions;
-
-        // Find the median value.
-        std::nth_element(arr, arr+n/2, arr+n,
-                         [dimension](T a, T b){return a.get(dimension) < b.get(dimension);});
-        double median_value = arr[n/2].get(dimension);
-
-        // Find the median index
-        T* median = std::partition(arr, arr+n,
-                                   [dimension, median_value](T a){
-                                     return a.get(dimension) < median_value;
-                                   });
-        size_t median_index = median - arr;
-
-        // Will be true so long as the coordinate is not equal for everything in this dimension.
-        if(median_index != 0 && median_index != n){
-          int next_dim = (dimension+1) % T::dimensions;
-          double median = arr[median_index].get(dimension);
-          return std::unique_ptr<InternalNode<T> >(new InternalNode<T>(
-                                                     make_node(arr, median_index, next_dim),
-                                                     make_node(arr+median_index,n-median_index, next_dim),
-                                                     dimension,median));
+      throw std::runtime_error("Invalid node in checkpoint");
+    }
+  }
+
+  std::shared_ptr<ThreadPool> pool;
+  std::unique_ptr<NodeBase<T> > root;
+  size_t built_size;
+};
+
+// A KD-tree that can be searched and popped from several threads at
+// once, without locks.
+//
+// Laid out like FlatKDTree, but popped values stay in place.  Each leaf
+// has a bitmask of its remaining values, and a pop claims a value by
+// clearing its bit with a compare-and-swap.  If another thread claimed
+// the value first, the search is repeated.  The counts of remaining
+// values in each node are decremented atomically after a claim, so
+// they may briefly overcount, but never undercount.
+template<typename T>
+class ConcurrentKDTree{
+public:
+  ConcurrentKDTree(std::vector<T> vec, std::shared_ptr<ThreadPool> pool = nullptr)
+    : values(build(std::move(vec), pool.get())) {
+    counts.reset(new std::atomic<int>[nodes.size()]);
+    for(size_t i=0; i<nodes.size(); i++){
+      counts[i] = nodes[i].size;
+    }
+
+    remaining.reset(new std::atomic<uint64_t>[num_words]);
+    for(auto& node : nodes){
+      if(is_leaf(node)){
+        for(size_t i=0; i<node.size; i+=64){
+          size_t bits = std::min<size_t>(node.size - i, 64);
+          remaining[node.word_begin + i/64] = (bits == 64) ? ~uint64_t(0) : ((uint64_t(1)<<bits) - 1);
+        }
+      }
+    }
+  }
+
+  ConcurrentKDTree(CheckpointReader& reader, std::shared_ptr<ThreadPool> = nullptr)
+    : nodes(reader.ReadVector<Node>()), num_words(reader.Read<uint64_t>()),
+      values(reader) {
+    counts.reset(new std::atomic<int>[nodes.size()]);
+    auto saved_counts = reader.ReadVector<int>();
+    if(saved_counts.size() != nodes.size()){
+      throw std::runtime_error("Invalid counts in checkpoint");
+    }
+    for(size_t i=0; i<nodes.size(); i++){
+      counts[i] = saved_counts[i];
+    }
+
+    remaining.reset(new std::atomic<uint64_t>[num_words]);
+    auto saved_remaining = reader.ReadVector<uint64_t>();
+    if(saved_remaining.size() != num_words){
+      throw std::runtime_error("Invalid bitmask in checkpoint");
+    }
+    for(size_t i=0; i<num_words; i++){
+      remaining[i] = saved_remaining[i];
+    }
+  }
+
+  // Must not be called while other threads are popping values.
+  void Save(CheckpointWriter& writer) const {
+    writer.WriteVector(nodes);
+    writer.Write<uint64_t>(num_words);
+    values.Save(writer);
+
+    std::vector<int> saved_counts(nodes.size());
+    for(size_t i=0; i<nodes.size(); i++){
+      saved_counts[i] = counts[i];
+    }
+    writer.WriteVector(saved_counts);
+
+    std::vector<uint64_t> saved_remaining(num_words);
+    for(size_t i=0; i<num_words; i++){
+      saved_remaining[i] = remaining[i];
+    }
+    writer.WriteVector(saved_remaining);
+  }
+
+  // Pops the closest value.  May be called from several threads at
+  // once, so long as no more values are popped than were added.
+  KDTree_Result<T> PopClosest(T query, double epsilon = 0){
+    KDTree_Result<T> output;
+    bool success = TryPopClosest(query, epsilon, output);
+    assert(success);
+    (void)success;
+    return output;
+  }
+
+  // Pops the closest value, if there are any left.  Returns false if
+  // the tree is empty.
+  bool TryPopClosest(T query, double epsilon, KDTree_Result<T>& output){
+    output.stats = PerformanceStats();
+    while(GetNumLeaves() > 0){
+      auto res = closest_node(0, query, epsilon, output.stats);
+      if(res.dist2 == DBL_MAX){
+        // Every value seen was claimed while searching.
+        continue;
+      }
+
+      const Node& leaf = nodes[res.leaf];
+      size_t offset = res.index - leaf.begin;
+      auto& word = remaining[leaf.word_begin + offset/64];
+      uint64_t bit = uint64_t(1) << (offset%64);
+
+      uint64_t current = word.load(std::memory_order_relaxed);
+      bool claimed = false;
+      while(current & bit){
+        if(word.compare_exchange_weak(current, current & ~bit, std::memory_order_acq_rel)){
+          claimed = true;
+          break;
         }
       }
 
-      // If we got here, then everything value remaining is equal.
-      std::vector<T> elements(arr,arr+n);
-      assert(elements.size() > 0);
-      return std::unique_ptr<LeafNode<T> >(new LeafNode<T>(elements));
+      if(claimed){
+        for(int node = res.leaf; node != -1; node = nodes[node].parent){
+          counts[node].fetch_sub(1, std::memory_order_relaxed);
+        }
+        output.res = values.Get(res.index);
+        return true;
+      }
     }
+    return false;
   }
 
-  std::unique_ptr<NodeBase<T> > root;
+  KDTree_Result<T> GetClosest(T query, double epsilon = 0){
+    KDTree_Result<T> output;
+    auto res = closest_node(0, query, epsilon, output.stats);
+    output.res = values.Get(res.index);
+    return output;
+  }
+
+  int GetNumLeaves(){
+    return counts[0].load(std::memory_order_relaxed);
+  }
+
+  size_t MemoryUsage() const {
+    return nodes.capacity()*sizeof(Node) + values.MemoryUsage() +
+      nodes.size()*sizeof(std::atomic<int>) + num_words*sizeof(std::atomic<uint64_t>);
+  }
+
+private:
+  struct Node{
+    // Index of the parent node, or -1 for the root.
+    int parent;
+    // Index of the right child.  The left child is always the next
+    // node.  Zero for leaf nodes, since the root is never a child.
+    int right;
+    int dimension;
+    double median;
+    // Range of values held by a leaf node, and the first word of its
+    // bitmask of remaining values.
+    size_t begin;
+    size_t size;
+    size_t word_begin;
+  };
+
+  struct SearchRes{
+    double dist2;
+    int leaf;
+    size_t index;
+  };
+
+  bool is_leaf(const Node& node) const {
+    return node.right == 0;
+  }
+
+  // Converts a bitmask of remaining values into one byte per value,
+  // nonzero for values that have been used.
+  static void expand_used_mask(uint64_t word, unsigned char* used){
+    static const std::vector<uint64_t> table = [](){
+      std::vector<uint64_t> output(256);
+      for(int bits=0; bits<256; bits++){
+        for(int i=0; i<8; i++){
+          if(!((bits >> i) & 1)){
+            output[bits] |= uint64_t(0xff) << 8*i;
+          }
+        }
+      }
+      return output;
+    }();
+
+    for(int i=0; i<8; i++){
+      std::memcpy(used + 8*i, &table[(word >> 8*i) & 0xff], 8);
+    }
+  }
+
+  std::vector<T> build(std::vector<T> vec, ThreadPool* pool){
+    assert(vec.size() > 0);
+    num_words = 0;
+    auto splits = kdtree_partition(vec.data(), vec.size(), pool);
+    size_t next_split = 0;
+    make_node(0, vec.size(), -1, splits, next_split);
+    return vec;
+  }
+
+  int make_node(size_t begin, size_t n, int parent,
+                const std::vector<KDTreeSplit>& splits, size_t& next_split){
+    assert(n>0);
+    KDTreeSplit split = splits[next_split++];
+    size_t median_index = split.median_index;
+    int dimension = split.dimension;
+    int index = nodes.size();
+    if(!median_index){
+      // Either few enough values for a leaf, or every value is equal.
+      nodes.push_back({parent, 0, 0, 0, begin, n, num_words});
+      num_words += (n+63)/64;
+      return index;
+    }
+
+    nodes.push_back({parent, 0, dimension, split.median, begin, n, 0});
+    make_node(begin, median_index, index, splits, next_split);
+    int right = make_node(begin+median_index, n-median_index, index, splits, next_split);
+    nodes[index].right = right;
+    return index;
+  }
+
+  SearchRes closest_node(int index, T query, double epsilon, PerformanceStats& stats){
+    const Node& node = nodes[index];
+
+    stats.nodes_checked += 1;
+
+    if(is_leaf(node)){
+      stats.leaf_nodes_checked += 1;
+      stats.points_checked += node.size;
+
+      SearchRes best = {DBL_MAX, index, node.begin};
+      unsigned char used[64];
+      for(size_t i=0; i<node.size; i+=64){
+        size_t n = std::min<size_t>(node.size - i, 64);
+        uint64_t word = remaining[node.word_begin + i/64].load(std::memory_order_acquire);
+        if(!word){
+          continue;
+        }
+        expand_used_mask(word, used);
+        auto res = values.Closest(query, node.begin + i, node.begin + i + n, used);
+        if(res.first < best.dist2){
+          best = {res.first, index, res.second};
+        }
+      }
+      return best;
+    }
+
+    int left = index + 1;
+    int right = node.right;
+
+    // If one of the branches is empty, this becomes really easy.
+    if(counts[left].load(std::memory_order_relaxed) == 0){
+      return closest_node(right, query, epsilon, stats);
+    } else if(counts[right].load(std::memory_order_relaxed) == 0){
+      return closest_node(left, query, epsilon, stats);
+    }
+
+    // Check on the side that is recommended by the median heuristic.
+    double diff = query.get(node.dimension) - node.median;
+    auto res1 = closest_node((diff<0) ? left : right, query, epsilon, stats);
+    double allowed_diff = diff*(1+epsilon);
+    if(allowed_diff * allowed_diff > res1.dist2){
+      return res1;
+    }
+
+    // Couldn't bail out early, so check on the other side and compare.
+    auto res2 = closest_node((diff<0) ? right : left, query, epsilon, stats);
+    return (res1.dist2 < res2.dist2) ? res1 : res2;
+  }
+
+  std::vector<Node> nodes;
+  size_t num_words;
+  LeafValues<T> values;
+  std::unique_ptr<std::atomic<int>[]> counts;
+  std::unique_ptr<std::atomic<uint64_t>[]> remaining;
 };
 
 #endif /* _KDTREE_H_ */
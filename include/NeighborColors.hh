@@ -0,0 +1,35 @@
+#ifndef _NEIGHBORCOLORS_H_
+#define _NEIGHBORCOLORS_H_
+
+#include <cassert>
+#include <cstddef> // for size_t
+
+#include "Color.hh"
+
+// The colors of the filled pixels around a location.  A pixel has at
+// most 8 neighbors, so they are stored in place, without allocation.
+class NeighborColors{
+public:
+  static const size_t max_size = 8;
+
+  NeighborColors() : num_colors(0) { }
+
+  void push_back(Color color){
+    assert(num_colors < max_size);
+    colors[num_colors++] = color;
+  }
+
+  size_t size() const { return num_colors; }
+  bool empty() const { return num_colors == 0; }
+
+  const Color& operator[](size_t i) const { return colors[i]; }
+
+  const Color* begin() const { return colors; }
+  const Color* end() const { return colors + num_colors; }
+
+private:
+  Color colors[max_size];
+  size_t num_colors;
+};
+
+#endif /* _NEIGHBORCOLORS_H_ */
@@ -0,0 +1,87 @@
+#ifndef _PACKEDKDTREE_H_
+#define _PACKEDKDTREE_H_
+
+#include <cstddef> // for size_t
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "Checkpoint.hh"
+#include "Color.hh"
+#include "KDTree.hh"
+
+// A KD-tree of colors with the same splitting rules and search
+// results as FlatKDTree<Color>, using as little memory per color as
+// possible.
+//
+// Each color takes 3 bytes, in the separate r/g/b arrays of
+// LeafValues<Color>.  Since a color channel is a single byte, so is
+// the median of each split, and a node fits in 12 bytes: the
+// remaining count, one link, and the split.  Nodes do not store their
+// parent.  The path from the root to a leaf is found again by index,
+// since the nodes are stored in pre-order.
+class PackedKDTree{
+public:
+  // If a thread pool is given, it is used to build and rebuild the
+  // tree in parallel.
+  PackedKDTree(std::vector<Color> colors, std::shared_ptr<ThreadPool> pool = nullptr);
+  PackedKDTree(CheckpointReader& reader, std::shared_ptr<ThreadPool> pool = nullptr);
+
+  void Save(CheckpointWriter& writer) const;
+
+  KDTree_Result<Color> PopClosest(Color query, double epsilon = 0);
+  KDTree_Result<Color> GetClosest(Color query, double epsilon = 0);
+
+  // As for FlatKDTree, finds the closest value to each query without
+  // removing any, and pops a value found unless removed since.  The
+  // queries are searched one at a time.
+  void FindClosest(const Color* queries, size_t n, double epsilon, KDTree_Found<Color>* output) const;
+  KDTree_Result<Color> PopFound(const KDTree_Found<Color>& found, Color query, double epsilon = 0);
+
+  int GetNumLeaves() const {
+    return nodes[0].num_leaves;
+  }
+
+  // Bytes used by the nodes and colors.
+  size_t MemoryUsage() const;
+
+private:
+  struct Node{
+    // Remaining values within this node.
+    uint32_t num_leaves;
+    // For internal nodes, the index of the right child.  The left
+    // child is always the next node.  For leaf nodes, the start of
+    // the values held by the leaf.
+    uint32_t link;
+    // Dimension of the split, or is_leaf.
+    uint8_t dimension;
+    uint8_t median;
+  };
+  static const uint8_t is_leaf = Color::dimensions;
+
+  struct SearchRes{
+    double dist2;
+    uint32_t leaf;
+    size_t index;
+  };
+
+  // Builds all nodes, and returns the values in leaf order.
+  std::vector<Color> build(std::vector<Color> colors);
+  void make_node(size_t begin, size_t n,
+                 const std::vector<KDTreeSplit>& splits, size_t& next_split);
+  void rebuild();
+  // Removes the value at the index, which must be among the remaining
+  // values of the leaf.
+  void pop_index(uint32_t leaf_index, size_t index);
+
+  SearchRes closest_node(uint32_t index, Color query, double epsilon,
+                         PerformanceStats& stats) const;
+
+  std::shared_ptr<ThreadPool> pool;
+  std::vector<Node> nodes;
+  size_t built_size;
+  unsigned int generation;
+  LeafValues<Color> values;
+};
+
+#endif /* _PACKEDKDTREE_H_ */
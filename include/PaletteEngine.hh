@@ -0,0 +1,150 @@
+#ifndef _PALETTEENGINE_H_
+#define _PALETTEENGINE_H_
+
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "Checkpoint.hh"
+#include "Color.hh"
+#include "FlatKDTree.hh"
+#include "KDTree.hh"
+#include "PackedKDTree.hh"
+
+// Interface to the data structures that can hold the remaining
+// colors of a UniquePalette.
+class PaletteEngine{
+public:
+  virtual ~PaletteEngine() {}
+
+  virtual KDTree_Result<Color> PopClosest(Color query, double epsilon) = 0;
+  virtual KDTree_Result<Color> GetClosest(Color query, double epsilon) = 0;
+  virtual int GetNumLeaves() = 0;
+
+  // Finds the closest color to each query, without removing any, so
+  // that PopFound() can later remove it without searching again.  Does
+  // not modify the engine, so may be called from several threads at
+  // once after FinishBuild().  Engines that cannot do so leave the
+  // results empty, and PopFound() searches instead.
+  virtual void FindClosest(const Color* /* queries */, size_t n, double /* epsilon */,
+                           KDTree_Found<Color>* output){
+    std::fill(output, output+n, KDTree_Found<Color>());
+  }
+
+  // Pops a color found by FindClosest(), or if it has been removed
+  // since, the closest remaining color to the query.
+  virtual KDTree_Result<Color> PopFound(const KDTree_Found<Color>& found,
+                                        Color query, double epsilon){
+    auto output = PopClosest(query, epsilon);
+    output.stats += found.result.stats;
+    return output;
+  }
+
+  // Whether PopClosest may be called from several threads at once.
+  virtual bool IsConcurrent() const { return false; }
+
+  // Finishes building any part of the engine left to be built by
+  // searches.  Must be called before GetClosest is called from several
+  // threads at once.
+  virtual void FinishBuild() { }
+
+  // Writes the exact state of the engine, to be read by the
+  // constructor of the same engine.
+  virtual void Save(CheckpointWriter& writer) const = 0;
+
+  // Approximate bytes used to hold the palette.
+  virtual size_t MemoryUsage() const = 0;
+};
+
+// Wraps any of the KD-tree implementations as a PaletteEngine.
+template<typename Tree>
+class TreePaletteEngine : public PaletteEngine{
+public:
+  // Any further arguments are passed on to the tree.
+  template<typename... Args>
+  TreePaletteEngine(std::vector<Color> colors, Args&&... args)
+    : tree(std::move(colors), std::forward<Args>(args)...) { }
+
+  template<typename... Args>
+  TreePaletteEngine(CheckpointReader& reader, Args&&... args)
+    : tree(reader, std::forward<Args>(args)...) { }
+
+  virtual KDTree_Result<Color> PopClosest(Color query, double epsilon){
+    return tree.PopClosest(query, epsilon);
+  }
+
+  virtual KDTree_Result<Color> GetClosest(Color query, double epsilon){
+    return tree.GetClosest(query, epsilon);
+  }
+
+  virtual int GetNumLeaves(){
+    return tree.GetNumLeaves();
+  }
+
+  virtual void Save(CheckpointWriter& writer) const {
+    tree.Save(writer);
+  }
+
+  virtual size_t MemoryUsage() const {
+    return sizeof(*this) + tree.MemoryUsage();
+  }
+
+protected:
+  Tree tree;
+};
+
+// Wraps a FlatKDTree, which may be built lazily.
+class FlatPaletteEngine : public TreePaletteEngine<FlatKDTree<Color> >{
+public:
+  FlatPaletteEngine(std::vector<Color> colors, std::shared_ptr<ThreadPool> pool, bool lazy)
+    : TreePaletteEngine<FlatKDTree<Color> >(std::move(colors), pool, lazy) { }
+
+  FlatPaletteEngine(CheckpointReader& reader, std::shared_ptr<ThreadPool> pool, bool lazy)
+    : TreePaletteEngine<FlatKDTree<Color> >(reader, pool, lazy) { }
+
+  virtual void FindClosest(const Color* queries, size_t n, double epsilon,
+                           KDTree_Found<Color>* output){
+    tree.FindClosest(queries, n, epsilon, output);
+  }
+
+  virtual KDTree_Result<Color> PopFound(const KDTree_Found<Color>& found,
+                                        Color query, double epsilon){
+    return tree.PopFound(found, query, epsilon);
+  }
+
+  virtual void FinishBuild(){
+    tree.FinishBuild();
+  }
+};
+
+// Wraps a PackedKDTree.
+class PackedPaletteEngine : public TreePaletteEngine<PackedKDTree>{
+public:
+  template<typename... Args>
+  PackedPaletteEngine(Args&&... args)
+    : TreePaletteEngine<PackedKDTree>(std::forward<Args>(args)...) { }
+
+  virtual void FindClosest(const Color* queries, size_t n, double epsilon,
+                           KDTree_Found<Color>* output){
+    tree.FindClosest(queries, n, epsilon, output);
+  }
+
+  virtual KDTree_Result<Color> PopFound(const KDTree_Found<Color>& found,
+                                        Color query, double epsilon){
+    return tree.PopFound(found, query, epsilon);
+  }
+};
+
+// Wraps a ConcurrentKDTree, which allows pops from several threads.
+class ConcurrentPaletteEngine : public TreePaletteEngine<ConcurrentKDTree<Color> >{
+public:
+  ConcurrentPaletteEngine(std::vector<Color> colors, std::shared_ptr<ThreadPool> pool = nullptr)
+    : TreePaletteEngine<ConcurrentKDTree<Color> >(std::move(colors), pool) { }
+
+  ConcurrentPaletteEngine(CheckpointReader& reader)
+    : TreePaletteEngine<ConcurrentKDTree<Color> >(reader) { }
+
+  virtual bool IsConcurrent() const { return true; }
+};
+
+#endif /* _PALETTEENGINE_H_ */
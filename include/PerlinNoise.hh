@@ -4,6 +4,7 @@
 #include <vector>
 #include <random>
 
+#include "Checkpoint.hh"
 #include "GVector.hh"
 
 // Creates 2-d Perlin noise
@@ -13,6 +14,12 @@ public:
   double operator()(double x, double y);
   double operator()(GVector<2> p);
 
+  // Sets output[i] to the noise at (i,j), for each i in [0,width).
+  // Gives exactly the values of operator()(i,j), but each octave is
+  // evaluated along the whole row at once, looking up the gradients
+  // of the row only once.
+  void Row(int j, int width, double* output);
+
   void SetOctaves(int octaves){
     this->octaves = octaves;
   }
@@ -27,10 +34,14 @@ public:
     return grid_size;
   }
 
+  void SaveState(CheckpointWriter& writer) const;
+  void LoadState(CheckpointReader& reader);
+
 private:
   double base_perlin(GVector<2> p);
 
   double interpolate(double v0, double v1, double t);
+  double smooth(double t);
   GVector<2> gradient_at(int i, int j);
 
   std::array<GVector<2>,256> gradients;
@@ -2,53 +2,169 @@
 #define _POINTTRACKER_H_
 
 #include <cmath>
-#include <unordered_map>
+#include <cstdint>
+#include <string>
+#include <unordered_set>
 #include <vector>
 
 #include <iostream>
 
+#include "Checkpoint.hh"
+#include "ImageBuffer.hh"
 #include "Point.hh"
 
+// Order in which points are kept in the frontier.
+//   Unordered: Points are stored in the order they were added, with
+//     removed points replaced by the last point.
+//   MaxPreference: Points are stored as a binary max-heap on their
+//     preference, so FrontierAtIndex(0) is the most preferred point.
+enum class FrontierOrder{ Unordered, MaxPreference };
+
+// When the preference of a point is found, as pixels are filled.
+//   EveryNeighbor: For the filled pixel and each of its neighbors,
+//     whether or not the point is added to the frontier.  Only points
+//     added to the frontier keep the value.
+//   OnEntry: Once for each point, as it is added to the frontier.
+//   OnFill: As it is added to the frontier, and again each time a
+//     neighbor is filled, for preferences that depend on the
+//     surrounding pixels.
+enum class PreferencePolicy{ EveryNeighbor, OnEntry, OnFill };
+
 class PointTracker{
 public:
-  PointTracker(int width, int height);
+  // If map_directory is given, the state of each pixel is held in a
+  // mapped file in that directory, as for ImageBuffer.
+  PointTracker(int width, int height, const std::string& map_directory = "");
 
   void Clear();
 
+  void SetFrontierOrder(FrontierOrder order);
+  FrontierOrder GetFrontierOrder() const { return order; }
+
   int FrontierSize() const;
-  bool IsFilled(Point p) const;
-  bool IsFilled(int i, int j) const;
+  bool IsFilled(Point p) const {
+    return pixel_state(p.i, p.j) == filled;
+  }
+  bool IsFilled(int i, int j) const {
+    return pixel_state(i, j) == filled;
+  }
   bool IsInFrontier(Point p) const;
   Point FrontierAtIndex(int i) const;
 
   int GetWidth() const { return width; }
   int GetHeight() const { return height; }
 
+  // Values of the pixel state for pixels that are not in the frontier.
+  // Pixels in the frontier hold their index in the frontier.
+  static const int32_t empty = -1;
+  static const int32_t filled = -2;
+
+  // The state of every pixel, and the frontier points, for reading
+  // directly.
+  const ImageBuffer<int32_t>& GetPixelState() const { return pixel_state; }
+  const std::vector<Point>& GetFrontier() const { return frontier_vector; }
+
   void AddToFrontier(Point p);
   Point& FrontierAtIndex(int i);
 
+  // Marks the pixel as filled, and adds its neighbors to the frontier,
+  // with preferences from func(point) as given by the policy.
   template<typename Callable>
-  void Fill(Point p, Callable func){
-    filled[p.j*width + p.i] = true;
+  void Fill(Point p, Callable func,
+            PreferencePolicy policy = PreferencePolicy::EveryNeighbor){
     RemoveFromFrontier(p);
+    pixel_state(p.i, p.j) = filled;
 
     for(int di=-1; di<=1; di++){
       for(int dj=-1; dj<=1; dj++){
         Point loc(p.i+di, p.j+dj);
-        loc.preference = func(loc);
+        if(policy == PreferencePolicy::EveryNeighbor){
+          loc.preference = func(loc);
+          AddToFrontier(loc);
+        } else if(is_empty(loc)){
+          loc.preference = func(loc);
+          AddToFrontier(loc);
+        } else if(policy == PreferencePolicy::OnFill && IsInFrontier(loc)){
+          SetPreference(pixel_state(loc.i, loc.j), func(loc));
+        }
+      }
+    }
+  }
+
+  // As Fill(), but for several pixels, none of which may be
+  // neighbors, and finds the preferences of all points around them at
+  // once, after every pixel is marked as filled and before any point
+  // is added to the frontier.  func(points) is given each point that
+  // needs a preference once, and sets the preference of each.
+  template<typename BatchCallable>
+  void FillBatch(const std::vector<Point>& filled_points, BatchCallable func,
+                 PreferencePolicy policy = PreferencePolicy::EveryNeighbor){
+    for(auto p : filled_points){
+      RemoveFromFrontier(p);
+      pixel_state(p.i, p.j) = filled;
+    }
+
+    std::vector<Point> points;
+    std::unordered_set<uint64_t> seen;
+    for(auto p : filled_points){
+      for(int di=-1; di<=1; di++){
+        for(int dj=-1; dj<=1; dj++){
+          Point loc(p.i+di, p.j+dj);
+          if(policy == PreferencePolicy::EveryNeighbor || is_empty(loc) ||
+             (policy == PreferencePolicy::OnFill && IsInFrontier(loc))){
+            uint64_t key = (uint64_t(uint32_t(loc.j)) << 32) | uint32_t(loc.i);
+            if(seen.insert(key).second){
+              points.push_back(loc);
+            }
+          }
+        }
+      }
+    }
+    if(points.empty()){
+      return;
+    }
+
+    func(points);
+    for(auto loc : points){
+      if(policy == PreferencePolicy::OnFill && IsInFrontier(loc)){
+        SetPreference(pixel_state(loc.i, loc.j), loc.preference);
+      } else {
         AddToFrontier(loc);
       }
     }
   }
 
+  // Changes the preference of the frontier point at the index, and
+  // moves it within the frontier if ordered.
+  void SetPreference(int index, double preference);
+
+  // Filled pixels are saved as a bitmask, and the frontier in its
+  // current order, so that a loaded tracker behaves identically.
+  void Save(CheckpointWriter& writer) const;
+  void Load(CheckpointReader& reader);
+
 private:
   void RemoveFromFrontier(Point p);
 
+  // Whether the point is in the image, but neither filled nor in the
+  // frontier.
+  bool is_empty(Point p) const {
+    return (p.i>=0 && p.i<width &&
+            p.j>=0 && p.j<height &&
+            pixel_state(p.i, p.j) == empty);
+  }
+
+  // Moves the frontier point at the index up or down the heap until
+  // the heap is valid.  Only used for FrontierOrder::MaxPreference.
+  void SiftUp(int index);
+  void SiftDown(int index);
+  void SetFrontierIndex(int index, Point p);
+
+  FrontierOrder order;
   int width;
   int height;
-  std::vector<bool> filled;
+  ImageBuffer<int32_t> pixel_state;
 
-  std::unordered_map<Point,int> frontier_map;
   std::vector<Point> frontier_vector;
 };
 
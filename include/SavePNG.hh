@@ -1,15 +1,40 @@
 #ifndef _SAVEPNG_H_
 #define _SAVEPNG_H_
 
+#include <functional>
 #include <string>
 #include <vector>
 
 #include "Color.hh"
 
-void SavePNG(const std::vector<Color> pixels, int width, int height,
-             const char *filepath);
+// Filter applied to each row before compression.  Adaptive chooses
+// the filter separately for each row.
+enum class PNGFilter{ None, Sub, Up, Average, Paeth, Adaptive };
 
-void SavePNG(const std::vector<Color> pixels, int width, int height,
-             const std::string &filepath);
+struct PNGOptions{
+  PNGOptions()
+    : compression_level(6), filter(PNGFilter::Adaptive), threads(1) { }
+
+  // zlib compression level, from 0 (none) to 9 (smallest).
+  int compression_level;
+  PNGFilter filter;
+  // Above 1, strips of rows are compressed in parallel, and the
+  // resulting deflate streams are joined together.
+  int threads;
+};
+
+// Gives the pixels of row j.  A row that is not stored contiguously
+// can be copied into buffer, which holds one row, and buffer returned.
+// Must be safe to call from several threads at once.
+typedef std::function<const Color*(int j, Color* buffer)> PNGRowSource;
+
+void SavePNG(const PNGRowSource& rows, int width, int height,
+             const std::string& filepath, const PNGOptions& options = PNGOptions());
+
+void SavePNG(const std::vector<Color>& pixels, int width, int height,
+             const char *filepath, const PNGOptions& options = PNGOptions());
+
+void SavePNG(const std::vector<Color>& pixels, int width, int height,
+             const std::string &filepath, const PNGOptions& options = PNGOptions());
 
 #endif /* _SAVEPNG_H_ */
@@ -0,0 +1,113 @@
+#ifndef _STATSBUFFER_H_
+#define _STATSBUFFER_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+#include "Checkpoint.hh"
+#include "ImageBuffer.hh"
+#include "KDTree.hh"
+
+// How much of the search statistics to keep for each pixel.
+//   None: Nothing is kept.
+//   Compact: Each count is kept in 16 bits, saturating at 65535.
+//   Full: The PerformanceStats are kept as they are.
+enum class StatsMode{ None, Compact, Full };
+
+struct CompactStats{
+  CompactStats() : nodes_checked(0), leaf_nodes_checked(0), points_checked(0) { }
+  CompactStats(const PerformanceStats& stats)
+    : nodes_checked(saturate(stats.nodes_checked)),
+      leaf_nodes_checked(saturate(stats.leaf_nodes_checked)),
+      points_checked(saturate(stats.points_checked)) { }
+
+  operator PerformanceStats() const {
+    PerformanceStats output;
+    output.nodes_checked = nodes_checked;
+    output.leaf_nodes_checked = leaf_nodes_checked;
+    output.points_checked = points_checked;
+    return output;
+  }
+
+  uint16_t nodes_checked;
+  uint16_t leaf_nodes_checked;
+  uint16_t points_checked;
+
+private:
+  static uint16_t saturate(unsigned int count){
+    return std::min<unsigned int>(count, UINT16_MAX);
+  }
+};
+
+// The search statistics of each pixel, indexed in the same way as an
+// ImageBuffer of the same size and storage.
+class StatsBuffer{
+public:
+  StatsBuffer() : mode(StatsMode::None) { }
+
+  StatsBuffer(int width, int height, StatsMode mode,
+              const std::string& map_directory = "")
+    : mode(mode) {
+    switch(mode){
+    case StatsMode::None:
+      break;
+    case StatsMode::Compact:
+      compact = ImageBuffer<CompactStats>(width, height, CompactStats(), map_directory);
+      break;
+    case StatsMode::Full:
+      full = ImageBuffer<PerformanceStats>(width, height, PerformanceStats(), map_directory);
+      break;
+    }
+  }
+
+  StatsMode GetMode() const { return mode; }
+
+  void Set(size_t index, const PerformanceStats& stats){
+    switch(mode){
+    case StatsMode::None:
+      break;
+    case StatsMode::Compact:
+      compact[index] = stats;
+      break;
+    case StatsMode::Full:
+      full[index] = stats;
+      break;
+    }
+  }
+
+  PerformanceStats Get(size_t index) const {
+    switch(mode){
+    case StatsMode::Compact:
+      return compact[index];
+    case StatsMode::Full:
+      return full[index];
+    case StatsMode::None:
+    default:
+      return PerformanceStats();
+    }
+  }
+
+  void Save(CheckpointWriter& writer) const {
+    writer.Write<int>(int(mode));
+    writer.WriteArray(compact.data(), compact.size());
+    writer.WriteArray(full.data(), full.size());
+  }
+
+  // Must be loaded into a buffer of the same size, storage, and mode.
+  void Load(CheckpointReader& reader){
+    if(reader.Read<int>() != int(mode)){
+      throw std::runtime_error("Checkpoint does not match this image");
+    }
+    reader.ReadArray(compact.data(), compact.size());
+    reader.ReadArray(full.data(), full.size());
+  }
+
+private:
+  StatsMode mode;
+  ImageBuffer<CompactStats> compact;
+  ImageBuffer<PerformanceStats> full;
+};
+
+#endif /* _STATSBUFFER_H_ */
@@ -0,0 +1,50 @@
+#ifndef _THREADPOOL_H_
+#define _THREADPOOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads, used to run loops in parallel.
+class ThreadPool{
+public:
+  // Total number of threads, including the thread that calls ParallelFor.
+  ThreadPool(int num_threads);
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  int GetNumThreads() const { return workers.size() + 1; }
+
+  // Calls func(i) for every i in [0,n), spread across all threads.
+  // Returns once all calls have finished.  If any call throws, one of
+  // the exceptions is rethrown here.
+  void ParallelFor(size_t n, const std::function<void(size_t)>& func);
+
+private:
+  void worker_loop();
+  void run_tasks();
+
+  std::vector<std::thread> workers;
+
+  std::mutex mutex;
+  std::condition_variable start_condition;
+  std::condition_variable done_condition;
+  int generation;
+  int active_workers;
+  bool shutdown;
+
+  const std::function<void(size_t)>* task;
+  size_t task_size;
+  size_t chunk_size;
+  std::atomic<size_t> next_index;
+  std::exception_ptr error;
+};
+
+#endif /* _THREADPOOL_H_ */
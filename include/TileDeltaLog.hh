@@ -0,0 +1,83 @@
+#ifndef _TILEDELTALOG_H_
+#define _TILEDELTALOG_H_
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "Color.hh"
+
+// A record of every frame of a growth, storing only the pixels that
+// changed since the previous frame.
+//
+// All integers are 32-bit little-endian.  The file starts with the
+// magic bytes "TDL1", followed by the width, height and tile size.
+// Each frame is then
+//   - The number of changed tiles.
+//   - For each changed tile:
+//     - The tile index, counting tiles across each row of tiles.
+//     - A bitmask of changed pixels, one bit per pixel of the tile in
+//       row-major order, least significant bit first.
+//     - The RGB values of each changed pixel, in the same order.
+//
+// The image before the first frame is black.
+
+// Writes a tile delta log.  The tiles given for each frame may include
+// unchanged tiles, but must include every changed tile.
+class TileDeltaWriter{
+public:
+  TileDeltaWriter(const std::string& filename, int width, int height, int tile_size);
+  ~TileDeltaWriter();
+  TileDeltaWriter(const TileDeltaWriter&) = delete;
+  TileDeltaWriter& operator=(const TileDeltaWriter&) = delete;
+
+  void WriteFrame(const std::vector<Color>& pixels, const std::vector<int>& changed_tiles);
+  void Close();
+
+private:
+  void write_u32(uint32_t value);
+
+  FILE* file;
+  int width;
+  int height;
+  int tile_size;
+  int tiles_across;
+
+  // The image as of the last frame written.
+  std::vector<Color> previous;
+  std::vector<unsigned char> mask;
+  std::vector<Color> changed;
+};
+
+// Reads a tile delta log, one frame at a time.
+class TileDeltaReader{
+public:
+  TileDeltaReader(const std::string& filename);
+  ~TileDeltaReader();
+  TileDeltaReader(const TileDeltaReader&) = delete;
+  TileDeltaReader& operator=(const TileDeltaReader&) = delete;
+
+  // Applies the next frame to the image.  Returns false if there are
+  // no more frames.
+  bool NextFrame();
+
+  const std::vector<Color>& GetPixels() const { return pixels; }
+  int GetWidth() const { return width; }
+  int GetHeight() const { return height; }
+
+private:
+  bool read_u32(uint32_t& value);
+  void read_bytes(void* data, size_t n);
+
+  FILE* file;
+  int width;
+  int height;
+  int tile_size;
+  int tiles_across;
+
+  std::vector<Color> pixels;
+  std::vector<unsigned char> mask;
+};
+
+#endif /* _TILEDELTALOG_H_ */
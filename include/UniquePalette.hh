@@ -9,21 +9,104 @@
 
 #include "Color.hh"
 #include "KDTree.hh"
+#include "PaletteEngine.hh"
+
+class ThreadPool;
+
+// Data structure used to find the closest remaining color.
+enum class PaletteBackend{
+  // KDTree<Color>, with heap-allocated nodes.
+  Tree,
+  // FlatKDTree<Color>, with nodes and values in contiguous arrays.
+  FlatTree,
+  // GridPalette, an occupancy pyramid over the RGB cube.
+  Grid,
+  // ConcurrentKDTree<Color>, which can be popped from several threads.
+  Concurrent,
+  // PackedKDTree, a FlatTree with smaller nodes.
+  Packed,
+  // Grid for palettes that densely fill the RGB cube, FlatTree otherwise.
+  Auto
+};
+
+const char* palette_backend_name(PaletteBackend backend);
 
 class UniquePalette{
 public:
   UniquePalette();
   ~UniquePalette();
   KDTree_Result<Color> PopClosest(Color col, double epsilon = 0);
+
+  // Pops the closest color for each of several targets.  Each color
+  // is given out at most once, so targets that would share a closest
+  // color get the next closest instead.  Requires ColorsRemaining() >=
+  // targets.size().
+  //
+  // Targets are popped in Morton order of their colors, so that
+  // consecutive searches visit the same parts of the palette.
+  //
+  // If a thread pool is given, all targets are first searched for
+  // without removing any colors, with the sorted targets split between
+  // the threads.  The FlatTree backend searches for each thread's
+  // targets together, in a single walk down the tree.  The colors
+  // found are then popped directly, and a target is only
+  // searched for again if an earlier target already took its color.
+  // The Tree backend cannot pop a color found earlier, so searches for
+  // each target as it is popped.  With the Concurrent backend, the pops
+  // are made directly from each thread instead, so which target wins a
+  // contested color is not deterministic.
+  //
+  // Without a pool, each target is searched for after the previous
+  // pops.  Nearby targets often share a closest color, and searching
+  // for them all up front would then search again for many of them.
+  std::vector<KDTree_Result<Color> > PopClosestBatch(const std::vector<Color>& targets,
+                                                     double epsilon = 0,
+                                                     ThreadPool* pool = nullptr);
   KDTree_Result<Color> PopBack();
   KDTree_Result<Color> PopRandom(std::mt19937& rng);
 
+  // Number of threads used to build KD-trees.  The trees built do
+  // not depend on the number of threads.
+  void SetBuildThreads(int threads);
+
+  // Whether a FlatTree palette is built lazily, splitting each part of
+  // the tree when first searched.  Gives the same results, but spreads
+  // the time to build the tree over the first searches.  The Auto
+  // backend then always uses a FlatTree, and SetPalette() throws for
+  // any other backend.  The first batch popped with a thread pool
+  // builds the rest of the tree in full, on a single thread.
+  void SetLazyBuild(bool lazy){ lazy_build = lazy; }
+
+  void SetBackend(PaletteBackend backend);
+  PaletteBackend GetBackend() const { return backend; }
+
   void SetPalette(std::vector<Color> colors);
   int ColorsRemaining();
 
+  // The backend in use, and the number of colors given to the last
+  // SetPalette().
+  PaletteBackend GetEngineBackend() const { return engine_backend; }
+  size_t GetPaletteSize() const { return palette_size; }
+  // Time taken by the last SetPalette() to build the engine.
+  double GetBuildSeconds() const { return build_seconds; }
+  // Approximate bytes used to hold the palette.
+  size_t MemoryUsage() const;
+
   void GenerateUniformPalette(int n_colors);
+
+  // Writes the remaining colors, exactly as held by the engine.
+  void Save(CheckpointWriter& writer) const;
+  void Load(CheckpointReader& reader);
 private:
-  std::unique_ptr<KDTree<Color> > colors;
+  PaletteBackend backend;
+  // The backend in use, with Auto resolved.
+  PaletteBackend engine_backend;
+  size_t palette_size;
+  double build_seconds;
+  bool lazy_build;
+  // Shared with the engine, which uses it to rebuild.
+  std::shared_ptr<ThreadPool> build_pool;
+  std::unique_ptr<PaletteEngine> colors;
 };
 
 #endif /* _UNIQUEPALETTE_H_ */
@@ -1,74 +1,103 @@
-#include <cstdio>
+#include <algorithm>
 #include <iostream>
 #include <memory>
-#include <sstream>
+#include <stdexcept>
 #include <string>
+#include <thread>
 
 #include <boost/program_options.hpp>
 
-#include "CompiledAlgorithms.hh"
+#include "FrameSink.hh"
+#include "GeneratorChoices.hh"
 #include "GrowthImage.hh"
+#include "TileDeltaLog.hh"
 
 void MakeVideo(GrowthImage& g, std::string output, int iterations_per_frame){
-  int err;
-  int picnum = 0;
+  const int framerate = 12;
 
-  err = system("rm -rf temp && mkdir temp");
-  if(err){
-    return;
-  }
+  std::unique_ptr<FrameSink> sink(new AsyncFrameSink(
+    OpenFrameSink(output, g.GetWidth(), g.GetHeight(), framerate)));
 
   for(int i=0; g.Iterate(); i++){
     if(i%iterations_per_frame==0){
-      std::stringstream ss;
-      ss << "temp/growth_" << picnum++ << ".png";
-      g.Save(ss.str());
+      sink->WriteFrame(g.GetPixels());
       std::cout << "\rIteration: (" << i << "/" << g.GetWidth()*g.GetHeight() << ")" << std::flush;
     }
   }
   std::cout << std::endl;
 
-  for(int i=0; i<24; i++){
-    std::stringstream ss;
-    ss << "temp/growth_" << picnum++ << ".png";
-    g.Save(ss.str());
+  for(int i=0; i<2*framerate; i++){
+    sink->WriteFrame(g.GetPixels());
   }
+  sink->Close();
+}
 
-  std::stringstream ss;
-  ss << "ffmpeg -f image2 -framerate 12 -i \"temp/growth_%d.png\" -s "
-     << g.GetWidth() << "x" << g.GetHeight()
-     << " -vcodec h264 -crf 18 -pix_fmt yuv420p"
-     << " " << output;
-  std::string str = ss.str();
-  err = system(str.c_str());
-  if(err){
-    return;
+void SaveImage(GrowthImage& g,
+               std::string output,
+               std::string output_stats){
+  g.Save(output);
+  if(!output_stats.empty()) {
+    g.SaveStats(output_stats);
   }
-  //err = system("rm -rf temp");
 }
 
 void MakeImage(GrowthImage& g,
                std::string output,
                std::string output_stats){
   g.IterateUntilDone();
-  g.Save(output);
-  if(!output_stats.empty()) {
-    g.SaveStats(output_stats);
+  SaveImage(g, output, output_stats);
+}
+
+void MakeDeltaLog(GrowthImage& g,
+                  std::string delta_log,
+                  std::string output,
+                  std::string output_stats,
+                  int iterations_per_frame){
+  TileDeltaWriter writer(delta_log, g.GetWidth(), g.GetHeight(), GrowthImage::tile_size);
+  g.SetTrackChangedTiles(true);
+
+  bool running = true;
+  for(int i=1; running; i++){
+    running = g.Iterate();
+    if(i%iterations_per_frame==0 || !running){
+      writer.WriteFrame(g.GetPixels(), g.GetChangedTiles());
+      g.ClearChangedTiles();
+    }
+    if(i%100000==0){
+      std::cout << "\rIteration: (" << i << "/" << g.GetWidth()*g.GetHeight() << ")" << std::flush;
+    }
   }
+  std::cout << std::endl;
+  writer.Close();
+
+  SaveImage(g, output, output_stats);
 }
 
-SmartEnum(LocationChoice, Random, Preferred, Sequential);
-SmartEnum(PreferenceChoice, Location, Perlin);
+SmartEnum(PreferencePolicyChoice, EveryNeighbor, OnEntry, OnFill);
+SmartEnum(PaletteChoice, Tree, FlatTree, Grid, Concurrent, Packed, Auto);
+SmartEnum(PNGFilterChoice, None, Sub, Up, Average, Paeth, Adaptive);
 
 int main(int argc, char** argv){
   int height, width;
   double epsilon;
   int iterations_per_frame;
+  int batch_size;
+  int threads;
+  int build_threads;
   LocationChoice location_choice;
   PreferenceChoice preference_choice;
+  PreferencePolicyChoice preference_policy_choice;
+  PaletteChoice palette_choice;
   int seed;
   std::string output;
   std::string output_stats;
+  std::string map_directory;
+  std::string delta_log;
+  int png_level;
+  PNGFilterChoice png_filter_choice;
+  int png_threads;
+  int checkpoint_every;
+  std::string checkpoint_file;
   int preferred_location_iterations;
   int perlin_octaves;
   double perlin_grid_size;
@@ -82,16 +111,48 @@ int main(int argc, char** argv){
      "Filename of lua script.  Overrides all other input options if present.")
     ("output,o", po::value(&output)->required(), "Output filename")
     ("output-stats", po::value(&output_stats), "Output stats image")
+    ("compact-stats", "Keep the stats for --output-stats in 6 bytes per pixel instead of 12, "
+     "saturating at 65535")
+    ("map-dir", po::value(&map_directory),
+     "Hold the pixels, stats, frontier, and Perlin field in memory-mapped files in this directory, "
+     "for images larger than memory.  Only for still images")
     ("width,w", po::value(&width)->default_value(256), "Width of the output image")
     ("height,h", po::value(&height)->default_value(128), "Height of the output image")
     ("epsilon,e", po::value(&epsilon)->default_value(5), "Epsilon (allowed error).  Zero = None allowed")
-    ("video,v", "Render as a video instead of a still image")
+    ("video,v", "Render as a video instead of a still image.  "
+     "Videos ending in .y4m are written uncompressed, others are encoded with ffmpeg")
     ("iter-per-frame", po::value(&iterations_per_frame)->default_value(1000),
      "Iterations between each frame")
+    ("png-level", po::value(&png_level)->default_value(6),
+     "zlib compression level of png output, from 0 (none) to 9 (smallest)")
+    ("png-filter", po::value(&png_filter_choice)->default_value(PNGFilterChoice::Adaptive),
+     "Row filter of png output")
+    ("png-threads", po::value(&png_threads)->default_value(1),
+     "Number of threads used to compress png output")
+    ("delta-log", po::value(&delta_log),
+     "Also record each frame to a tile delta log, to be rendered later with replay")
+    ("checkpoint-every", po::value(&checkpoint_every)->default_value(0),
+     "Save a checkpoint each time this many more pixels have been filled.  Zero = Never")
+    ("checkpoint-file", po::value(&checkpoint_file),
+     "Filename of checkpoint.  Defaults to the output filename with \".checkpoint\" appended")
+    ("resume", "Continue from the checkpoint, which must have been made with the same options")
+    ("batch-size", po::value(&batch_size)->default_value(1),
+     "Number of pixels to choose and fill together in each iteration")
+    ("threads,t", po::value(&threads)->default_value(1),
+     "Number of threads used to find colors.  Implies a batch size of 32 per thread, unless given")
+    ("build-threads", po::value(&build_threads)->default_value(0),
+     "Number of threads used to build the palette and Perlin field.  Zero = One per core")
+    ("lazy-palette", "Build a FlatTree palette as it is searched, instead of before the first pixel.  Requires --palette FlatTree or Auto")
     ("location,l", po::value(&location_choice)->default_value(LocationChoice::Random),
      "Algorithm for selecting the next pixel to fill")
     ("preference,p", po::value(&preference_choice)->default_value(PreferenceChoice::Location),
-     "Algorithm for setting the location preference, for LocationAlgorithm \"Preferred\"")
+     "Algorithm for setting the location preference, for LocationAlgorithm \"Preferred\" or \"Priority\"")
+    ("preference-policy",
+     po::value(&preference_policy_choice)->default_value(PreferencePolicyChoice::EveryNeighbor),
+     "When to find the preference of a point: for every neighbor of each filled pixel, "
+     "once as it enters the frontier, or also again as each neighbor is filled")
+    ("palette", po::value(&palette_choice)->default_value(PaletteChoice::Auto),
+     "Data structure used to find the closest remaining color")
     ("perlin-octaves", po::value(&perlin_octaves)->default_value(7),
      "Number of octaves of perlin noise to add together")
     ("perlin-grid", po::value(&perlin_grid_size)->default_value(50),
@@ -122,41 +183,129 @@ int main(int argc, char** argv){
   }
 
 
+  if(build_threads <= 0){
+    build_threads = std::thread::hardware_concurrency();
+  }
+
   std::unique_ptr<GrowthImage> g;
   if(vm.count("input")){
     g = std::unique_ptr<GrowthImage>(new GrowthImage(lua_scriptname.c_str()));
   } else {
     g = std::unique_ptr<GrowthImage>(new GrowthImage(width,height,seed));
 
-    switch(location_choice){
-    case LocationChoice::Random:
-      g->SetLocationGenerator(generate_frontier_location);
+    SetChosenGenerators(*g, location_choice, preference_choice,
+                        preferred_location_iterations, perlin_grid_size, perlin_octaves,
+                        build_threads, map_directory);
+
+    switch(palette_choice){
+    case PaletteChoice::Tree:
+      g->SetPaletteBackend(PaletteBackend::Tree);
       break;
-    case LocationChoice::Sequential:
-      g->SetLocationGenerator(generate_sequential_location(width,height));
+    case PaletteChoice::FlatTree:
+      g->SetPaletteBackend(PaletteBackend::FlatTree);
       break;
-    case LocationChoice::Preferred:
-      g->SetLocationGenerator(generate_preferred_location(preferred_location_iterations));
+    case PaletteChoice::Grid:
+      g->SetPaletteBackend(PaletteBackend::Grid);
       break;
-    }
-
-    switch(preference_choice){
-    case PreferenceChoice::Location:
-      g->SetPreferenceGenerator(generate_location_preference());
+    case PaletteChoice::Concurrent:
+      g->SetPaletteBackend(PaletteBackend::Concurrent);
+      break;
+    case PaletteChoice::Packed:
+      g->SetPaletteBackend(PaletteBackend::Packed);
       break;
-    case PreferenceChoice::Perlin:
-      g->SetPreferenceGenerator(generate_perlin_preference(perlin_grid_size,
-                                                           perlin_octaves,
-                                                           g->GetRNG()));
+    case PaletteChoice::Auto:
+      g->SetPaletteBackend(PaletteBackend::Auto);
       break;
     }
 
     g->SetEpsilon(epsilon);
+    if(threads > 1 && vm["batch-size"].defaulted()){
+      batch_size = 32*threads;
+    }
+    g->SetBatchSize(batch_size);
+    g->SetThreads(threads);
   }
 
-  if(vm.count("video")){
-    MakeVideo(*g, output, iterations_per_frame);
-  } else {
-    MakeImage(*g, output, output_stats);
+  g->SetBuildThreads(build_threads);
+
+  switch(preference_policy_choice){
+  case PreferencePolicyChoice::EveryNeighbor:
+    g->SetPreferencePolicy(PreferencePolicy::EveryNeighbor);
+    break;
+  case PreferencePolicyChoice::OnEntry:
+    g->SetPreferencePolicy(PreferencePolicy::OnEntry);
+    break;
+  case PreferencePolicyChoice::OnFill:
+    g->SetPreferencePolicy(PreferencePolicy::OnFill);
+    break;
+  }
+  g->SetLazyPalette(vm.count("lazy-palette"));
+
+  PNGOptions png_options;
+  png_options.compression_level = std::min(std::max(png_level, 0), 9);
+  png_options.threads = png_threads;
+  switch(png_filter_choice){
+  case PNGFilterChoice::None:
+    png_options.filter = PNGFilter::None;
+    break;
+  case PNGFilterChoice::Sub:
+    png_options.filter = PNGFilter::Sub;
+    break;
+  case PNGFilterChoice::Up:
+    png_options.filter = PNGFilter::Up;
+    break;
+  case PNGFilterChoice::Average:
+    png_options.filter = PNGFilter::Average;
+    break;
+  case PNGFilterChoice::Paeth:
+    png_options.filter = PNGFilter::Paeth;
+    break;
+  case PNGFilterChoice::Adaptive:
+    png_options.filter = PNGFilter::Adaptive;
+    break;
+  }
+  g->SetPNGOptions(png_options);
+
+  // Stats take more memory than the image itself, so are only kept
+  // when they will be saved.
+  if(output_stats.empty()){
+    g->SetStatsMode(StatsMode::None);
+  } else if(vm.count("compact-stats")){
+    g->SetStatsMode(StatsMode::Compact);
+  }
+
+  if(checkpoint_file.empty()){
+    checkpoint_file = output + ".checkpoint";
+  }
+  bool checkpoints = checkpoint_every > 0 || vm.count("resume");
+
+  try{
+    if(vm.count("video") && vm.count("delta-log")){
+      throw std::runtime_error("--delta-log cannot be combined with --video");
+    }
+    if(checkpoints && (vm.count("video") || vm.count("delta-log"))){
+      throw std::runtime_error("Checkpoints are only supported for still images");
+    }
+    if(!map_directory.empty()){
+      if(vm.count("video") || vm.count("delta-log")){
+        throw std::runtime_error("Memory-mapped images are only supported for still images");
+      }
+      g->SetMapDirectory(map_directory);
+    }
+    if(vm.count("resume")){
+      g->LoadCheckpoint(checkpoint_file);
+    }
+    g->SetCheckpointing(checkpoint_file, checkpoint_every);
+
+    if(vm.count("video")){
+      MakeVideo(*g, output, iterations_per_frame);
+    } else if(vm.count("delta-log")){
+      MakeDeltaLog(*g, delta_log, output, output_stats, iterations_per_frame);
+    } else {
+      MakeImage(*g, output, output_stats);
+    }
+  } catch (std::runtime_error& e){
+    std::cerr << "ERROR: " << e.what() << std::endl;
+    return 1;
   }
 }
@@ -0,0 +1,105 @@
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include <boost/program_options.hpp>
+
+#include "FrameSink.hh"
+#include "SavePNG.hh"
+#include "TileDeltaLog.hh"
+
+// Renders a video from every frame_step-th frame of a delta log,
+// followed by a two second hold on the final image.
+void ReplayVideo(std::string input, std::string output,
+                 int frame_step, int framerate){
+  TileDeltaReader reader(input);
+  std::unique_ptr<FrameSink> sink(new AsyncFrameSink(
+    OpenFrameSink(output, reader.GetWidth(), reader.GetHeight(), framerate)));
+
+  int frame = 0;
+  for(; reader.NextFrame(); frame++){
+    if(frame%frame_step==0){
+      sink->WriteFrame(reader.GetPixels());
+      std::cout << "\rFrame: " << frame << std::flush;
+    }
+  }
+  std::cout << std::endl;
+
+  for(int i=0; i<2*framerate; i++){
+    sink->WriteFrame(reader.GetPixels());
+  }
+  sink->Close();
+}
+
+// Saves a single frame as a png.  A negative frame number counts back
+// from the end of the log.
+void ReplayImage(std::string input, std::string output, int frame){
+  if(frame < 0){
+    TileDeltaReader counter(input);
+    int num_frames = 0;
+    while(counter.NextFrame()){
+      num_frames++;
+    }
+    frame += num_frames;
+  }
+
+  TileDeltaReader reader(input);
+  for(int i=0; i<=frame; i++){
+    if(!reader.NextFrame()){
+      throw std::runtime_error("Frame " + std::to_string(frame) + " is past the end of the log");
+    }
+  }
+  SavePNG(reader.GetPixels(), reader.GetWidth(), reader.GetHeight(), output);
+}
+
+int main(int argc, char** argv){
+  std::string input;
+  std::string output;
+  int frame;
+  int frame_step;
+  int framerate;
+
+  namespace po = boost::program_options;
+  po::options_description desc("Options");
+  desc.add_options()
+    ("input,i", po::value(&input)->required(), "Tile delta log, as written by --delta-log")
+    ("output,o", po::value(&output)->required(),
+     "Output filename.  Videos ending in .y4m are written uncompressed, others are encoded with ffmpeg")
+    ("frame,f", po::value(&frame),
+     "Save only this frame as a png image.  Negative values count back from the last frame")
+    ("frame-step", po::value(&frame_step)->default_value(1),
+     "Number of logged frames per video frame")
+    ("framerate", po::value(&framerate)->default_value(12), "Frames per second of the video")
+    ("help","Print help message")
+    ;
+
+  po::variables_map vm;
+  try{
+    po::store(po::parse_command_line(argc,argv,desc),vm);
+
+    if(vm.count("help")){
+      std::cout << "Growth Replay" << std::endl
+                << desc << std::endl;
+      return 0;
+    }
+
+    po::notify(vm);
+  } catch (po::error& e){
+    std::cerr << "ERROR: " << e.what() << std::endl
+              << desc << std::endl;
+    return 1;
+  }
+
+  try{
+    if(vm.count("frame")){
+      ReplayImage(input, output, frame);
+    } else {
+      ReplayVideo(input, output, std::max(frame_step, 1), framerate);
+    }
+  } catch (std::runtime_error& e){
+    std::cerr << "ERROR: " << e.what() << std::endl;
+    return 1;
+  }
+}
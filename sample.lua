@@ -5,8 +5,70 @@ height = 1080
 epsilon = 5
 seed = 0
 
-color_palette = uniform_color_palette
-initial_location = generate_random_start
-next_location = choose_frontier_location
-location_preference = null_preference
-target_color = target_average_color
+-- Generators left to the built-in functions are called directly,
+-- without calling into lua for each pixel.  Any generator not named
+-- here must be defined by the script, such as
+--   next_location = choose_frontier_location
+use_builtin("color_palette")
+use_builtin("initial_location")
+use_builtin("next_location")
+use_builtin("location_preference")
+use_builtin("target_color")
+
+-- Optional: number of pixels to fill in each iteration.
+-- set_batch_size(64)
+
+-- Optional: versions of location_preference and target_color that are
+-- called once for many points, returning a list with one result per
+-- point.  Named with use_batch(), they are used instead.  The
+-- preferences of the points around all pixels filled by an iteration
+-- are found with one call.
+-- use_batch("location_preference")
+-- function location_preference_batch(rand, points, point_tracker)
+--    local output = {}
+--    for k, p in ipairs(points) do
+--       output[k] = -p:GetJ()
+--    end
+--    return output
+-- end
+--
+-- use_batch("target_color")
+-- function target_color_batch(rand, neighbor_lists, points)
+--    local output = {}
+--    for k, neighbors in ipairs(neighbor_lists) do
+--       output[k] = target_average_color(rand, neighbors, points[k])
+--    end
+--    return output
+-- end
+
+-- Functions can also read the image directly, without copying, by
+-- casting these addresses with the LuaJIT FFI.  They change whenever
+-- the image is reallocated, so should be fetched in each call.
+--   pixel_address():       3 bytes (r, g, b) per pixel.
+--   pixel_state_address(): int32_t per pixel.  -2 if filled, -1 if
+--                          empty, otherwise the index in the frontier.
+--   frontier_address():    frontier_size() points, each
+--                          {int32_t i, j; double preference}.
+--   buffer_tile_bits():    0 if pixels are stored row by row, otherwise
+--                          log2 of the side of the square tiles that
+--                          each hold a contiguous block of pixels.
+--
+-- Pixels are indexed as below in both pixel_address() and
+-- pixel_state_address().
+--
+-- local ffi = require("ffi")
+-- function buffer_index(i, j)
+--    local bits = buffer_tile_bits()
+--    if bits == 0 then
+--       return j*width + i
+--    end
+--    local side = 2^bits
+--    local tiles_across = math.floor((width + side - 1)/side)
+--    local tile = math.floor(j/side)*tiles_across + math.floor(i/side)
+--    return (tile*side + j%side)*side + i%side
+-- end
+--
+-- function is_filled(i, j)
+--    local state = ffi.cast("int32_t*", pixel_state_address())
+--    return state[buffer_index(i, j)] == -2
+-- end
@@ -0,0 +1,63 @@
+#include "Checkpoint.hh"
+
+#include <cstdio>
+
+CheckpointWriter::CheckpointWriter(const std::string& filename)
+  : filename(filename), temp_filename(filename + ".tmp"), offset(0) {
+  file = fopen(temp_filename.c_str(), "wb");
+  if(!file){
+    throw std::runtime_error("Could not open " + temp_filename);
+  }
+}
+
+CheckpointWriter::~CheckpointWriter(){
+  if(file){
+    fclose(file);
+    remove(temp_filename.c_str());
+  }
+}
+
+void CheckpointWriter::Close(){
+  int err = ferror(file) | fclose(file);
+  file = NULL;
+  if(err || rename(temp_filename.c_str(), filename.c_str())){
+    throw std::runtime_error("Could not write " + filename);
+  }
+}
+
+void CheckpointWriter::write_bytes(const void* data, size_t n){
+  fwrite(data, 1, n, file);
+  offset += n;
+}
+
+void CheckpointWriter::align(){
+  const char padding[8] = {};
+  write_bytes(padding, (8 - offset%8)%8);
+}
+
+CheckpointReader::CheckpointReader(const std::string& filename)
+  : offset(0) {
+  file = fopen(filename.c_str(), "rb");
+  if(!file){
+    throw std::runtime_error("Could not open " + filename);
+  }
+  fseek(file, 0, SEEK_END);
+  size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+}
+
+CheckpointReader::~CheckpointReader(){
+  fclose(file);
+}
+
+void CheckpointReader::read_bytes(void* data, size_t n){
+  if(n > remaining_bytes() || fread(data, 1, n, file) != n){
+    throw std::runtime_error("Checkpoint is truncated");
+  }
+  offset += n;
+}
+
+void CheckpointReader::align(){
+  char padding[8];
+  read_bytes(padding, (8 - offset%8)%8);
+}
@@ -0,0 +1,200 @@
+#include "ColorScan.hh"
+
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+  #define COLORSCAN_X86
+  #include <immintrin.h>
+#endif
+
+namespace {
+  // Scans the colors in [begin,n), and merges with the result found so far.
+  ColorScanResult scan_tail(const unsigned char* r,
+                            const unsigned char* g,
+                            const unsigned char* b,
+                            const unsigned char* used,
+                            size_t begin, size_t n, Color query,
+                            ColorScanResult best){
+    for(size_t i=begin; i<n; i++){
+      if(used && used[i]){
+        continue;
+      }
+      int dr = int(r[i]) - query.r;
+      int dg = int(g[i]) - query.g;
+      int db = int(b[i]) - query.b;
+      int dist2 = dr*dr + dg*dg + db*db;
+      if(dist2 < best.dist2){
+        best.dist2 = dist2;
+        best.index = i;
+      }
+    }
+    return best;
+  }
+
+#ifdef COLORSCAN_X86
+  // Reduces per-lane (distance, index) pairs to the single best,
+  // preferring the lowest index on ties.
+  ColorScanResult reduce_lanes(const int32_t* dist, const int32_t* index, int lanes){
+    ColorScanResult best = {INT_MAX, 0};
+    for(int i=0; i<lanes; i++){
+      if(dist[i] < best.dist2 ||
+         (dist[i] == best.dist2 && dist[i] != INT_MAX && size_t(index[i]) < best.index)){
+        best.dist2 = dist[i];
+        best.index = index[i];
+      }
+    }
+    return best;
+  }
+
+  // Squared distance of 4 colors, given the 16-bit per-channel
+  // differences in the low or high half of each register.
+  inline __m128i sse2_dist2(__m128i dr, __m128i dg, __m128i db, bool high){
+    __m128i zero = _mm_setzero_si128();
+    __m128i rg = high ? _mm_unpackhi_epi16(dr, dg) : _mm_unpacklo_epi16(dr, dg);
+    __m128i b0 = high ? _mm_unpackhi_epi16(db, zero) : _mm_unpacklo_epi16(db, zero);
+    return _mm_add_epi32(_mm_madd_epi16(rg, rg), _mm_madd_epi16(b0, b0));
+  }
+
+  // Keeps the (distance, index) of each lane where the new distance is
+  // strictly smaller, so that the first occurrence wins.
+  inline void sse2_update(__m128i dist, __m128i index, __m128i& best_dist, __m128i& best_index){
+    __m128i better = _mm_cmplt_epi32(dist, best_dist);
+    best_dist = _mm_or_si128(_mm_and_si128(better, dist),
+                             _mm_andnot_si128(better, best_dist));
+    best_index = _mm_or_si128(_mm_and_si128(better, index),
+                              _mm_andnot_si128(better, best_index));
+  }
+
+  ColorScanResult closest_sse2(const unsigned char* r,
+                               const unsigned char* g,
+                               const unsigned char* b,
+                               const unsigned char* used,
+                               size_t n, Color query){
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i qr = _mm_set1_epi16(query.r);
+    const __m128i qg = _mm_set1_epi16(query.g);
+    const __m128i qb = _mm_set1_epi16(query.b);
+    const __m128i int_max = _mm_set1_epi32(INT_MAX);
+    const __m128i four = _mm_set1_epi32(4);
+    const __m128i eight = _mm_set1_epi32(8);
+
+    __m128i best_dist = int_max;
+    __m128i best_index = _mm_setzero_si128();
+    __m128i index_lo = _mm_setr_epi32(0, 1, 2, 3);
+
+    size_t i = 0;
+    for(; i+8 <= n; i+=8){
+      __m128i vr = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(r+i)), zero);
+      __m128i vg = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(g+i)), zero);
+      __m128i vb = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(b+i)), zero);
+      __m128i dr = _mm_sub_epi16(vr, qr);
+      __m128i dg = _mm_sub_epi16(vg, qg);
+      __m128i db = _mm_sub_epi16(vb, qb);
+
+      __m128i dist_lo = sse2_dist2(dr, dg, db, false);
+      __m128i dist_hi = sse2_dist2(dr, dg, db, true);
+
+      if(used){
+        // Widen the used bytes to 32-bit lane masks, and push used
+        // lanes to INT_MAX so they can never be selected.
+        __m128i u16 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(used+i)), zero);
+        __m128i mask_lo = _mm_cmpgt_epi32(_mm_unpacklo_epi16(u16, zero), zero);
+        __m128i mask_hi = _mm_cmpgt_epi32(_mm_unpackhi_epi16(u16, zero), zero);
+        dist_lo = _mm_or_si128(_mm_andnot_si128(mask_lo, dist_lo),
+                               _mm_and_si128(mask_lo, int_max));
+        dist_hi = _mm_or_si128(_mm_andnot_si128(mask_hi, dist_hi),
+                               _mm_and_si128(mask_hi, int_max));
+      }
+
+      sse2_update(dist_lo, index_lo, best_dist, best_index);
+      sse2_update(dist_hi, _mm_add_epi32(index_lo, four), best_dist, best_index);
+      index_lo = _mm_add_epi32(index_lo, eight);
+    }
+
+    alignas(16) int32_t dist_arr[4];
+    alignas(16) int32_t index_arr[4];
+    _mm_store_si128((__m128i*)dist_arr, best_dist);
+    _mm_store_si128((__m128i*)index_arr, best_index);
+    return scan_tail(r, g, b, used, i, n, query, reduce_lanes(dist_arr, index_arr, 4));
+  }
+
+  __attribute__((target("avx2")))
+  ColorScanResult closest_avx2(const unsigned char* r,
+                               const unsigned char* g,
+                               const unsigned char* b,
+                               const unsigned char* used,
+                               size_t n, Color query){
+    const __m256i qr = _mm256_set1_epi32(query.r);
+    const __m256i qg = _mm256_set1_epi32(query.g);
+    const __m256i qb = _mm256_set1_epi32(query.b);
+    const __m256i int_max = _mm256_set1_epi32(INT_MAX);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i eight = _mm256_set1_epi32(8);
+
+    __m256i best_dist = int_max;
+    __m256i best_index = _mm256_setzero_si256();
+    __m256i index = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+
+    size_t i = 0;
+    for(; i+8 <= n; i+=8){
+      __m256i dr = _mm256_sub_epi32(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(r+i))), qr);
+      __m256i dg = _mm256_sub_epi32(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(g+i))), qg);
+      __m256i db = _mm256_sub_epi32(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(b+i))), qb);
+      __m256i dist = _mm256_add_epi32(_mm256_add_epi32(_mm256_mullo_epi32(dr, dr),
+                                                       _mm256_mullo_epi32(dg, dg)),
+                                      _mm256_mullo_epi32(db, db));
+
+      if(used){
+        __m256i mask = _mm256_cmpgt_epi32(
+          _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(used+i))), zero);
+        dist = _mm256_blendv_epi8(dist, int_max, mask);
+      }
+
+      __m256i better = _mm256_cmpgt_epi32(best_dist, dist);
+      best_dist = _mm256_blendv_epi8(best_dist, dist, better);
+      best_index = _mm256_blendv_epi8(best_index, index, better);
+      index = _mm256_add_epi32(index, eight);
+    }
+
+    alignas(32) int32_t dist_arr[8];
+    alignas(32) int32_t index_arr[8];
+    _mm256_store_si256((__m256i*)dist_arr, best_dist);
+    _mm256_store_si256((__m256i*)index_arr, best_index);
+    return scan_tail(r, g, b, used, i, n, query, reduce_lanes(dist_arr, index_arr, 8));
+  }
+#endif
+
+  typedef ColorScanResult (*ScanFunc)(const unsigned char*, const unsigned char*,
+                                      const unsigned char*, const unsigned char*,
+                                      size_t, Color);
+
+  ScanFunc select_scan(){
+#ifdef COLORSCAN_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")){
+      return closest_avx2;
+    }
+    if(__builtin_cpu_supports("sse2")){
+      return closest_sse2;
+    }
+#endif
+    return ClosestColorScalar;
+  }
+}
+
+ColorScanResult ClosestColorScalar(const unsigned char* r,
+                                   const unsigned char* g,
+                                   const unsigned char* b,
+                                   const unsigned char* used,
+                                   size_t n, Color query){
+  return scan_tail(r, g, b, used, 0, n, query, {INT_MAX, 0});
+}
+
+ColorScanResult ClosestColor(const unsigned char* r,
+                             const unsigned char* g,
+                             const unsigned char* b,
+                             const unsigned char* used,
+                             size_t n, Color query){
+  static const ScanFunc scan_impl = select_scan();
+  return scan_impl(r, g, b, used, n, query);
+}
@@ -1,14 +1,15 @@
 #include "CompiledAlgorithms.hh"
 
 #include <cassert>
-#include <cfloat>
 #include <cmath>
 
 #include <iostream>
 
+#include "ThreadPool.hh"
+
 std::vector<Color> generate_uniform_palette(RandomInt, int n_colors){
   assert(n_colors > 0);
-  assert(n_colors < (1<<24));
+  assert(n_colors <= (1<<24));
 
   double dim_size = std::pow(n_colors,1.0/3.0);
 
@@ -35,71 +36,29 @@ std::vector<Color> generate_uniform_palette(RandomInt, int n_colors){
   return colors;
 }
 
-std::vector<Point> generate_random_start(RandomInt rand, int width, int height){
-  std::vector<Point> output;
-  output.push_back({rand(0,width), rand(0,height)});
-  return output;
-}
-
-Point generate_frontier_location(RandomInt rand, const PointTracker& point_tracker){
-  return point_tracker.FrontierAtIndex(
-    rand(0, point_tracker.FrontierSize()));
-}
-
-Point generate_sequential_location::operator()(RandomInt, const PointTracker&){
-  i++;
-  if(i==width){
-    i = 0;
-    j++;
-  }
-  return {i,j};
-}
-
-Point generate_preferred_location::operator()(RandomInt rand, const PointTracker& point_tracker){
-  int best_index = 0;
-  double best_preference = -DBL_MAX;
-  for(int i=0; i<n; i++){
-    int index = rand(0, point_tracker.FrontierSize() );
-    auto p = point_tracker.FrontierAtIndex(index);
-
-    if(p.preference > best_preference){
-      best_preference = p.preference;
-      best_index = index;
-    }
-  }
-
-  return point_tracker.FrontierAtIndex(best_index);
+generate_perlin_field_preference::generate_perlin_field_preference(
+  int width, int height, double grid_size, int octaves, std::mt19937& rng,
+  int threads, const std::string& map_directory)
+  : perlin(rng), width(width), height(height), threads(threads),
+    map_directory(map_directory) {
+  perlin.SetGridSize(grid_size);
+  perlin.SetOctaves(octaves);
 }
 
-double generate_null_preference(RandomInt, Point, const PointTracker&){
-  return 0;
-}
-
-double generate_location_preference::operator()(RandomInt rand, Point p, const PointTracker& point_tracker){
-  if(goal_loc == -1 || point_tracker.IsFilled(goal_loc.i, goal_loc.j)){
-    goal_loc = {rand(0, point_tracker.GetWidth()),
-                rand(0, point_tracker.GetHeight())};
-  }
-
-  double di = p.i - goal_loc.i;
-  double dj = p.j - goal_loc.j;
-  return -(di*di + dj*dj);
+void generate_perlin_field_preference::compute_field(){
+  field = std::make_shared<ImageBuffer<float> >(width, height, 0.0f, map_directory);
+  ThreadPool pool(threads);
+  pool.ParallelFor(height, [&](size_t j){
+      std::vector<double> row(width);
+      perlin.Row(j, width, row.data());
+      for(int i=0; i<width; i++){
+        (*field)(i,j) = row[i];
+      }
+    });
 }
 
-Color generate_average_color(RandomInt rand, std::vector<Color> neighbors, Point){
-  if(neighbors.size()){
-    Color output(0,0,0);
-    for(auto col : neighbors){
-      output.r += col.r/neighbors.size();
-      output.g += col.g/neighbors.size();
-      output.b += col.b/neighbors.size();
-    }
-    return output;
-  } else {
-    return {
-      (unsigned char)rand(0,255),
-      (unsigned char)rand(0,255),
-      (unsigned char)rand(0,255)
-    };
-  }
+std::vector<Point> generate_random_start(RandomInt rand, int width, int height){
+  std::vector<Point> output;
+  output.push_back({rand(0,width), rand(0,height)});
+  return output;
 }
@@ -0,0 +1,237 @@
+#include "FrameSink.hh"
+
+#include <algorithm>
+#include <csignal>
+#include <ctime>
+#include <sstream>
+#include <stdexcept>
+
+#include <pthread.h>
+#include <signal.h>
+
+static_assert(sizeof(Color) == 3,
+              "Color must be packed, to be written directly as RGB24");
+
+namespace {
+  // Quotes a string to be passed as a single word to the shell.
+  std::string shell_quote(const std::string& str){
+    std::string output = "'";
+    for(char c : str){
+      if(c == '\''){
+        output += "'\\''";
+      } else {
+        output += c;
+      }
+    }
+    return output + "'";
+  }
+
+  // Blocks SIGPIPE in the current thread while in scope.  If ffmpeg
+  // exits early, writes to it then fail and are reported, instead of
+  // the process being killed.  Any SIGPIPE raised meanwhile is
+  // discarded before unblocking, so no other part of the program is
+  // affected.
+  class BlockSigpipe{
+  public:
+    BlockSigpipe(){
+      sigemptyset(&sigpipe);
+      sigaddset(&sigpipe, SIGPIPE);
+      sigset_t pending;
+      sigpending(&pending);
+      was_pending = sigismember(&pending, SIGPIPE);
+      pthread_sigmask(SIG_BLOCK, &sigpipe, &old_mask);
+    }
+
+    ~BlockSigpipe(){
+      sigset_t pending;
+      sigpending(&pending);
+      if(!was_pending && sigismember(&pending, SIGPIPE)){
+        struct timespec no_wait = {0, 0};
+        sigtimedwait(&sigpipe, NULL, &no_wait);
+      }
+      pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    }
+
+  private:
+    sigset_t sigpipe;
+    sigset_t old_mask;
+    bool was_pending;
+  };
+}
+
+FFmpegFrameSink::FFmpegFrameSink(const std::string& output, int width, int height, int framerate)
+  : FrameSink(width, height) {
+  std::stringstream ss;
+  ss << "ffmpeg -y -loglevel error"
+     << " -f rawvideo -pix_fmt rgb24"
+     << " -s " << width << "x" << height
+     << " -framerate " << framerate
+     << " -i -"
+     << " -vcodec h264 -crf 18 -pix_fmt yuv420p"
+     << " " << shell_quote(output);
+  pipe = popen(ss.str().c_str(), "w");
+  if(!pipe){
+    throw std::runtime_error("Could not start ffmpeg");
+  }
+}
+
+FFmpegFrameSink::~FFmpegFrameSink(){
+  if(pipe){
+    BlockSigpipe block;
+    pclose(pipe);
+  }
+}
+
+void FFmpegFrameSink::WriteFrame(const std::vector<Color>& pixels){
+  size_t num_pixels = width*height;
+  BlockSigpipe block;
+  if(fwrite(pixels.data(), sizeof(Color), num_pixels, pipe) != num_pixels){
+    throw std::runtime_error("Could not write frame to ffmpeg");
+  }
+}
+
+void FFmpegFrameSink::Close(){
+  BlockSigpipe block;
+  int status = pclose(pipe);
+  pipe = NULL;
+  if(status){
+    throw std::runtime_error("ffmpeg exited with an error");
+  }
+}
+
+Y4MFrameSink::Y4MFrameSink(const std::string& output, int width, int height, int framerate)
+  : FrameSink(width, height), planes(3*width*height) {
+  file = fopen(output.c_str(), "wb");
+  if(!file){
+    throw std::runtime_error("Could not open " + output);
+  }
+  fprintf(file, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444\n", width, height, framerate);
+}
+
+Y4MFrameSink::~Y4MFrameSink(){
+  if(file){
+    fclose(file);
+  }
+}
+
+void Y4MFrameSink::WriteFrame(const std::vector<Color>& pixels){
+  // BT.601, limited range.
+  size_t num_pixels = width*height;
+  unsigned char* y = planes.data();
+  unsigned char* cb = y + num_pixels;
+  unsigned char* cr = cb + num_pixels;
+  for(size_t i=0; i<num_pixels; i++){
+    int r = pixels[i].r;
+    int g = pixels[i].g;
+    int b = pixels[i].b;
+    y[i]  = ((  66*r + 129*g +  25*b + 128) >> 8) + 16;
+    cb[i] = (( -38*r -  74*g + 112*b + 128) >> 8) + 128;
+    cr[i] = (( 112*r -  94*g -  18*b + 128) >> 8) + 128;
+  }
+
+  fputs("FRAME\n", file);
+  if(fwrite(planes.data(), 1, planes.size(), file) != planes.size()){
+    throw std::runtime_error("Could not write frame");
+  }
+}
+
+void Y4MFrameSink::Close(){
+  int err = fclose(file);
+  file = NULL;
+  if(err){
+    throw std::runtime_error("Could not finish writing video");
+  }
+}
+
+std::unique_ptr<FrameSink> OpenFrameSink(const std::string& output, int width, int height, int framerate){
+  if(output.size() >= 4 && output.substr(output.size()-4) == ".y4m"){
+    return std::unique_ptr<FrameSink>(new Y4MFrameSink(output, width, height, framerate));
+  } else {
+    return std::unique_ptr<FrameSink>(new FFmpegFrameSink(output, width, height, framerate));
+  }
+}
+
+AsyncFrameSink::AsyncFrameSink(std::unique_ptr<FrameSink> sink_in, int num_buffers)
+  : FrameSink(sink_in->GetWidth(), sink_in->GetHeight()),
+    sink(std::move(sink_in)), buffers(std::max(num_buffers, 1)), finished(false) {
+  for(size_t i=0; i<buffers.size(); i++){
+    free_buffers.push_back(i);
+  }
+  writer = std::thread(&AsyncFrameSink::WriterLoop, this);
+}
+
+AsyncFrameSink::~AsyncFrameSink(){
+  StopWriter();
+}
+
+void AsyncFrameSink::WriteFrame(const std::vector<Color>& pixels){
+  int index;
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    buffer_freed.wait(lock, [this](){ return !free_buffers.empty() || error; });
+    if(error){
+      std::rethrow_exception(error);
+    }
+    index = free_buffers.back();
+    free_buffers.pop_back();
+  }
+
+  buffers[index].assign(pixels.begin(), pixels.end());
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    queued_buffers.push_back(index);
+  }
+  frame_queued.notify_one();
+}
+
+void AsyncFrameSink::Close(){
+  StopWriter();
+  if(error){
+    std::rethrow_exception(error);
+  }
+  sink->Close();
+}
+
+void AsyncFrameSink::StopWriter(){
+  if(writer.joinable()){
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      finished = true;
+    }
+    frame_queued.notify_one();
+    writer.join();
+  }
+}
+
+void AsyncFrameSink::WriterLoop(){
+  while(true){
+    int index;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      frame_queued.wait(lock, [this](){ return !queued_buffers.empty() || finished; });
+      if(queued_buffers.empty()){
+        return;
+      }
+      index = queued_buffers.front();
+      queued_buffers.pop_front();
+    }
+
+    try{
+      sink->WriteFrame(buffers[index]);
+    } catch (...) {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        error = std::current_exception();
+      }
+      buffer_freed.notify_all();
+      return;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      free_buffers.push_back(index);
+    }
+    buffer_freed.notify_one();
+  }
+}
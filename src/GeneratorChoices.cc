@@ -0,0 +1,78 @@
+#include "GeneratorChoices.hh"
+
+#include "CompiledAlgorithms.hh"
+
+namespace {
+  // Gives the generators to the image with their exact types, so that
+  // the per-pixel calls are inlined.
+  template<typename Location>
+  void SetGenerators(GrowthImage& g, Location location,
+                     PreferenceChoice preference_choice,
+                     double perlin_grid_size, int perlin_octaves,
+                     int field_threads, const std::string& map_directory){
+    auto target_color = [](RandomInt& rand, const NeighborColors& neighbors, Point p){
+      return generate_average_color(rand, neighbors, p);
+    };
+
+    switch(preference_choice){
+    case PreferenceChoice::Location:
+      g.SetCompiledGenerators(location, generate_location_preference(), target_color);
+      break;
+    case PreferenceChoice::Perlin:
+      g.SetCompiledGenerators(location,
+                              generate_perlin_preference(perlin_grid_size,
+                                                         perlin_octaves,
+                                                         g.GetRNG()),
+                              target_color);
+      break;
+    case PreferenceChoice::PerlinField:
+      g.SetCompiledGenerators(location,
+                              generate_perlin_field_preference(g.GetWidth(), g.GetHeight(),
+                                                               perlin_grid_size,
+                                                               perlin_octaves,
+                                                               g.GetRNG(),
+                                                               field_threads,
+                                                               map_directory),
+                              target_color);
+      break;
+    }
+  }
+}
+
+void SetChosenGenerators(GrowthImage& g, LocationChoice location_choice,
+                         PreferenceChoice preference_choice,
+                         int preferred_location_iterations,
+                         double perlin_grid_size, int perlin_octaves,
+                         int field_threads, const std::string& map_directory){
+  g.SetGeneratorNames(location_choice.toString(), preference_choice.toString());
+
+  switch(location_choice){
+  case LocationChoice::Random:
+    SetGenerators(g,
+                  [](RandomInt& rand, const PointTracker& point_tracker){
+                    return generate_frontier_location(rand, point_tracker);
+                  },
+                  preference_choice, perlin_grid_size, perlin_octaves,
+                  field_threads, map_directory);
+    break;
+  case LocationChoice::Sequential:
+    SetGenerators(g, generate_sequential_location(g.GetWidth(), g.GetHeight()),
+                  preference_choice, perlin_grid_size, perlin_octaves,
+                  field_threads, map_directory);
+    break;
+  case LocationChoice::Preferred:
+    SetGenerators(g, generate_preferred_location(preferred_location_iterations),
+                  preference_choice, perlin_grid_size, perlin_octaves,
+                  field_threads, map_directory);
+    break;
+  case LocationChoice::Priority:
+    SetGenerators(g,
+                  [](RandomInt& rand, const PointTracker& point_tracker){
+                    return generate_priority_location(rand, point_tracker);
+                  },
+                  preference_choice, perlin_grid_size, perlin_octaves,
+                  field_threads, map_directory);
+    g.SetFrontierOrder(FrontierOrder::MaxPreference);
+    break;
+  }
+}
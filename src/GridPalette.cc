@@ -0,0 +1,202 @@
+#include "GridPalette.hh"
+
+#include <algorithm>
+#include <cassert>
+#include <climits>
+#include <stdexcept>
+
+namespace {
+  // Spreads the 8 bits of a value so that there are two zero bits
+  // between each.
+  size_t spread_bits(size_t val){
+    val = (val | (val << 8)) & 0x00F00F;
+    val = (val | (val << 4)) & 0x0C30C3;
+    val = (val | (val << 2)) & 0x249249;
+    return val;
+  }
+}
+
+GridPalette::GridPalette(const std::vector<Color>& palette)
+  : colors(1<<24, 0) {
+  assert(palette.size() > 0);
+
+  for(auto col : palette){
+    auto& count = colors[MortonIndex(col)];
+    if(count == 255){
+      throw std::runtime_error("Grid palette cannot hold a color more than 255 times");
+    }
+    count++;
+  }
+
+  build_blocks();
+}
+
+GridPalette::GridPalette(CheckpointReader& reader)
+  : colors(size_t(1)<<24) {
+  reader.ReadArray(colors.data(), colors.size());
+  build_blocks();
+}
+
+void GridPalette::Save(CheckpointWriter& writer) const {
+  // The blocks are cheap to recount, so only the colors are saved.
+  writer.WriteVector(colors);
+}
+
+size_t GridPalette::MemoryUsage() const {
+  size_t output = sizeof(*this) + colors.capacity();
+  for(const auto& block : blocks){
+    output += block.capacity()*sizeof(unsigned int);
+  }
+  return output;
+}
+
+void GridPalette::build_blocks(){
+  blocks.resize(num_levels-1);
+  for(int level=1; level<num_levels; level++){
+    auto& block = blocks[level-1];
+    block.assign(size_t(1) << 3*(8-level), 0);
+    for(size_t i=0; i<block.size(); i++){
+      for(size_t child=8*i; child<8*i+8; child++){
+        block[i] += count(level-1, child);
+      }
+    }
+  }
+}
+
+bool GridPalette::IsSuitable(const std::vector<Color>& palette){
+  // Sparser palettes leave many near-empty blocks to search through,
+  // and are faster with a KD-tree.
+  if(palette.size() < (1<<22)){
+    return false;
+  }
+
+  std::vector<unsigned char> counts(1<<24, 0);
+  for(auto col : palette){
+    auto& count = counts[MortonIndex(col)];
+    if(count == 255){
+      return false;
+    }
+    count++;
+  }
+  return true;
+}
+
+size_t GridPalette::MortonIndex(Color col){
+  return spread_bits(col.r) | (spread_bits(col.g) << 1) | (spread_bits(col.b) << 2);
+}
+
+unsigned int GridPalette::count(int level, size_t index) const {
+  return level ? blocks[level-1][index] : colors[index];
+}
+
+int GridPalette::GetNumLeaves(){
+  return blocks.back()[0];
+}
+
+KDTree_Result<Color> GridPalette::GetClosest(Color query, double epsilon){
+  assert(GetNumLeaves() > 0);
+
+  KDTree_Result<Color> output;
+  SearchRes best = {INT_MAX, 0, 0, 0};
+  search(num_levels-1, 0, 0, 0, 0, query, (1+epsilon)*(1+epsilon), best, output.stats);
+  output.res = Color(best.r, best.g, best.b);
+  return output;
+}
+
+KDTree_Result<Color> GridPalette::PopClosest(Color query, double epsilon){
+  auto output = GetClosest(query, epsilon);
+  remove(MortonIndex(output.res));
+  return output;
+}
+
+void GridPalette::FindClosest(const Color* queries, size_t n, double epsilon,
+                              KDTree_Found<Color>* output){
+  for(size_t i=0; i<n; i++){
+    output[i] = KDTree_Found<Color>();
+    output[i].result = GetClosest(queries[i], epsilon);
+    output[i].leaf = 0;
+    output[i].index = MortonIndex(output[i].result.res);
+  }
+}
+
+KDTree_Result<Color> GridPalette::PopFound(const KDTree_Found<Color>& found,
+                                           Color query, double epsilon){
+  if(found.leaf >= 0 && colors[found.index]){
+    remove(found.index);
+    return found.result;
+  }
+
+  auto output = PopClosest(query, epsilon);
+  output.stats += found.result.stats;
+  return output;
+}
+
+void GridPalette::remove(size_t index){
+  assert(colors[index] > 0);
+  colors[index]--;
+  for(int level=1; level<num_levels; level++){
+    blocks[level-1][index >> 3*level]--;
+  }
+}
+
+void GridPalette::search(int level, size_t index, int x, int y, int z, Color query,
+                         double epsilon_factor, SearchRes& best, PerformanceStats& stats) const {
+  stats.nodes_checked += 1;
+
+  if(level == 1){
+    stats.leaf_nodes_checked += 1;
+  }
+
+  struct Child{
+    int dist2;
+    int child;
+  };
+  Child children[8];
+  int num_children = 0;
+
+  int child_level = level - 1;
+  int size = 1 << child_level;
+  for(int child=0; child<8; child++){
+    if(!count(child_level, 8*index + child)){
+      continue;
+    }
+
+    // Distance from the query to the nearest point of the block.
+    int dist2 = 0;
+    int coords[3] = {2*x + (child&1), 2*y + ((child>>1)&1), 2*z + (child>>2)};
+    for(int dim=0; dim<3; dim++){
+      int low = coords[dim]*size;
+      int high = low + size - 1;
+      int q = query.get(dim);
+      int diff = (q < low) ? low - q : ((q > high) ? q - high : 0);
+      dist2 += diff*diff;
+    }
+
+    // Insertion sort, closest blocks first.
+    int i = num_children++;
+    while(i > 0 && children[i-1].dist2 > dist2){
+      children[i] = children[i-1];
+      i--;
+    }
+    children[i] = {dist2, child};
+  }
+
+  for(int i=0; i<num_children; i++){
+    int dist2 = children[i].dist2;
+    if(dist2 * epsilon_factor >= best.dist2){
+      // All later blocks are at least as far away.
+      break;
+    }
+
+    int child = children[i].child;
+    int cx = 2*x + (child&1);
+    int cy = 2*y + ((child>>1)&1);
+    int cz = 2*z + (child>>2);
+    if(child_level == 0){
+      stats.points_checked += 1;
+      best = {dist2, cx, cy, cz};
+    } else {
+      search(child_level, 8*index + child, cx, cy, cz, query, epsilon_factor, best, stats);
+    }
+  }
+}
@@ -4,16 +4,38 @@
 #include <algorithm>
 #include <cassert>
 #include <cfloat>
+#include <climits>
 #include <cmath>
+#include <cstdint>
 #include <ctime>
 #include <iostream>
+#include <set>
+#include <sstream>
 #include <stdexcept>
 
 #include "lua-bindings/LuaState.hh"
 
 #include "common.hh"
 #include "CompiledAlgorithms.hh"
-#include "SavePNG.hh"
+
+namespace {
+  // Signatures of the per-pixel generators as seen by lua, which
+  // passes all arguments by value.
+  typedef std::function<Point(RandomInt,const PointTracker&)> LuaLocationGenerator;
+  typedef std::function<double(RandomInt,Point,const PointTracker&)> LuaPreferenceGenerator;
+  typedef std::function<Color(RandomInt,std::vector<Color>,Point)> LuaTargetColorGenerator;
+  typedef std::function<std::vector<double>(RandomInt,std::vector<Point>,const PointTracker&)>
+    LuaPreferenceBatchGenerator;
+  typedef std::function<std::vector<Color>(RandomInt,std::vector<std::vector<Color> >,
+                                           std::vector<Point>)> LuaTargetColorBatchGenerator;
+
+  // Addresses are passed to lua as numbers.  The bindings cannot push
+  // light userdata, but a double holds any user-space address exactly,
+  // as these are below 2^53.
+  double lua_address(const void* ptr){
+    return double(reinterpret_cast<uintptr_t>(ptr));
+  }
+}
 
 GrowthImage::GrowthImage(int width, int height, int seed)
   : state(NULL),
@@ -23,12 +45,20 @@ GrowthImage::GrowthImage(int width, int height, int seed)
     preference_generator(generate_null_preference),
     target_color_generator(generate_average_color),
     point_tracker(width, height),
+    preference_policy(PreferencePolicy::EveryNeighbor),
     epsilon(0),
+    batch_size(1),
     width(width),
     height(height),
-    pixels(width*height, Color(0,0,0)),
-    stats(width*height),
-    rng(seed ? seed : time(0)) {
+    pixels(width, height, Color(0,0,0)),
+    stats(width, height, StatsMode::Full),
+    num_filled(0),
+    checkpoint_every(0),
+    phase_timing(false),
+    track_changed_tiles(false),
+    seed(seed ? seed : time(0)),
+    seed_from_time(seed == 0),
+    rng(this->seed) {
 
   rand_int = [this](int a, int b){
     if(a >= b){
@@ -39,7 +69,9 @@ GrowthImage::GrowthImage(int width, int height, int seed)
 }
 
 GrowthImage::GrowthImage(const char* luascript_filename)
-  : point_tracker(0,0) {
+  : point_tracker(0,0), preference_policy(PreferencePolicy::EveryNeighbor),
+    batch_size(1), num_filled(0), checkpoint_every(0), phase_timing(false),
+    track_changed_tiles(false), seed(0), seed_from_time(false) {
 
   state = new Lua::LuaState;
   state->LoadSafeLibs();
@@ -60,30 +92,169 @@ GrowthImage::GrowthImage(const char* luascript_filename)
     .AddMethod<bool, int, int>("IsFilled", &PointTracker::IsFilled)
     .AddMethod("IsInFrontier", &PointTracker::IsInFrontier);
 
+  // The pixels, the state of each pixel, and the frontier, as raw
+  // memory for scripts that read it directly, such as through the
+  // LuaJIT FFI.  Addresses are given as numbers, and change whenever
+  // a buffer is reallocated, so should be fetched again in each call.
+  static_assert(sizeof(Color) == 3, "Scripts read colors as 3 bytes");
+  static_assert(sizeof(Point) == 16, "Scripts read points as 2 ints and a double");
+  state->SetGlobal("pixel_address", std::function<double()>([this](){
+        return lua_address(pixels.data());
+      }));
+  state->SetGlobal("pixel_state_address", std::function<double()>([this](){
+        return lua_address(point_tracker.GetPixelState().data());
+      }));
+  state->SetGlobal("frontier_address", std::function<double()>([this](){
+        return lua_address(point_tracker.GetFrontier().data());
+      }));
+  state->SetGlobal("frontier_size", std::function<int()>([this](){
+        return point_tracker.FrontierSize();
+      }));
+  state->SetGlobal("buffer_tile_bits", std::function<int()>([this](){
+        return pixels.IsMapped() ? ImageBuffer<Color>::tile_bits : 0;
+      }));
+
   state->SetGlobal("uniform_color_palette", generate_uniform_palette);
   state->SetGlobal("generate_random_start", generate_random_start);
-  state->SetGlobal("choose_frontier_location", generate_frontier_location);
-  state->SetGlobal("null_preference", generate_null_preference);
-  state->SetGlobal("target_average_color", generate_average_color);
+  state->SetGlobal("choose_frontier_location", LuaLocationGenerator(
+    [](RandomInt rand, const PointTracker& point_tracker){
+      return generate_frontier_location(rand, point_tracker);
+    }));
+  state->SetGlobal("null_preference", LuaPreferenceGenerator(
+    [](RandomInt rand, Point p, const PointTracker& point_tracker){
+      return generate_null_preference(rand, p, point_tracker);
+    }));
+  state->SetGlobal("target_average_color", LuaTargetColorGenerator(
+    [](RandomInt rand, std::vector<Color> colors, Point p){
+      if(colors.size() > NeighborColors::max_size){
+        throw std::runtime_error("Too many neighboring colors");
+      }
+      NeighborColors neighbors;
+      for(auto color : colors){
+        neighbors.push_back(color);
+      }
+      return generate_average_color(rand, neighbors, p);
+    }));
+
+  // Scripts name the generators left to the built-in functions, and
+  // those given as batch functions, before they are read below.
+  // Built-in generators are then called directly, without going
+  // through lua, and batch generators replace the per-pixel ones.
+  auto builtins = std::make_shared<std::set<std::string> >();
+  auto batches = std::make_shared<std::set<std::string> >();
+  state->SetGlobal("use_builtin", std::function<void(std::string)>([builtins](std::string name){
+        if(name != "color_palette" && name != "initial_location" &&
+           name != "next_location" && name != "location_preference" &&
+           name != "target_color"){
+          throw std::runtime_error("No built-in generator for " + name);
+        }
+        builtins->insert(name);
+      }));
+  state->SetGlobal("use_batch", std::function<void(std::string)>([batches](std::string name){
+        if(name != "location_preference" && name != "target_color"){
+          throw std::runtime_error("No batch generator for " + name);
+        }
+        batches->insert(name);
+      }));
+  state->SetGlobal("set_batch_size", std::function<void(int)>([this](int size){
+        SetBatchSize(size);
+      }));
 
   state->LoadFile(luascript_filename);
 
-  palette_generator = state->CastGlobal<PaletteGenerator>("color_palette");
-  initial_location_generator = state->CastGlobal<InitialLocationGenerator>("initial_location");
-  location_generator = state->CastGlobal<LocationGenerator>("next_location");
-  preference_generator = state->CastGlobal<PreferenceGenerator>("location_preference");
-  target_color_generator = state->CastGlobal<TargetColorGenerator>("target_color");
+  bool native_palette = builtins->count("color_palette");
+  bool native_initial_location = builtins->count("initial_location");
+  bool native_location = builtins->count("next_location");
+  bool native_preference = builtins->count("location_preference");
+  bool native_target_color = builtins->count("target_color");
+  bool has_preference_batch = batches->count("location_preference");
+  bool has_target_color_batch = batches->count("target_color");
+
+  if(native_palette){
+    palette_generator = generate_uniform_palette;
+  } else {
+    palette_generator = state->CastGlobal<PaletteGenerator>("color_palette");
+  }
+  if(native_initial_location){
+    initial_location_generator = generate_random_start;
+  } else {
+    initial_location_generator = state->CastGlobal<InitialLocationGenerator>("initial_location");
+  }
+
+  if(native_location){
+    location_generator = generate_frontier_location;
+  } else {
+    auto lua_location = state->CastGlobal<LuaLocationGenerator>("next_location");
+    location_generator = [lua_location](RandomInt& rand, const PointTracker& point_tracker){
+      return lua_location(rand, point_tracker);
+    };
+  }
+
+  if(has_preference_batch){
+    auto lua_preference = state->CastGlobal<LuaPreferenceBatchGenerator>("location_preference_batch");
+    preference_batch_generator = [lua_preference](RandomInt& rand, const std::vector<Point>& points,
+                                                  const PointTracker& point_tracker){
+      return lua_preference(rand, points, point_tracker);
+    };
+  }
+  if(native_preference || has_preference_batch){
+    preference_generator = generate_null_preference;
+  } else {
+    auto lua_preference = state->CastGlobal<LuaPreferenceGenerator>("location_preference");
+    preference_generator = [lua_preference](RandomInt& rand, Point p, const PointTracker& point_tracker){
+      return lua_preference(rand, p, point_tracker);
+    };
+  }
+
+  if(has_target_color_batch){
+    auto lua_target_color = state->CastGlobal<LuaTargetColorBatchGenerator>("target_color_batch");
+    target_color_batch_generator = [lua_target_color](RandomInt& rand,
+                                                      const std::vector<NeighborColors>& neighbors,
+                                                      const std::vector<Point>& points){
+      std::vector<std::vector<Color> > colors;
+      colors.reserve(neighbors.size());
+      for(const auto& n : neighbors){
+        colors.emplace_back(n.begin(), n.end());
+      }
+      return lua_target_color(rand, std::move(colors), points);
+    };
+  }
+  if(native_target_color || has_target_color_batch){
+    target_color_generator = generate_average_color;
+  } else {
+    auto lua_target_color = state->CastGlobal<LuaTargetColorGenerator>("target_color");
+    target_color_generator = [lua_target_color](RandomInt& rand, const NeighborColors& neighbors, Point p){
+      return lua_target_color(rand, std::vector<Color>(neighbors.begin(), neighbors.end()), p);
+    };
+  }
+
+  if(native_location && native_preference && native_target_color){
+    SetCompiledGenerators(
+      [](RandomInt& rand, const PointTracker& point_tracker){
+        return generate_frontier_location(rand, point_tracker);
+      },
+      [](RandomInt& rand, Point p, const PointTracker& point_tracker){
+        return generate_null_preference(rand, p, point_tracker);
+      },
+      [](RandomInt& rand, const NeighborColors& neighbors, Point p){
+        return generate_average_color(rand, neighbors, p);
+      });
+  }
 
   width = state->CastGlobal<int>("width");
   height = state->CastGlobal<int>("height");
-  pixels = std::vector<Color>(width*height);
-  stats = std::vector<PerformanceStats>(width*height);
+  pixels = ImageBuffer<Color>(width, height);
+  stats = StatsBuffer(width, height, StatsMode::Full);
 
   epsilon = state->CastGlobal<double>("epsilon");
-  int seed = state->CastGlobal<int>("seed");
+  seed = state->CastGlobal<int>("seed");
+  seed_from_time = (seed == 0);
+  if(seed_from_time){
+    seed = time(0);
+  }
 
   point_tracker = PointTracker(width, height);
-  rng = std::mt19937(seed ? seed : time(0));
+  rng = std::mt19937(seed);
 
   rand_int = [this](int a, int b){
     if(a >= b){
@@ -100,7 +271,14 @@ GrowthImage::~GrowthImage(){
   }
 }
 
+void GrowthImage::SetGeneratorNames(const std::string& location, const std::string& preference){
+  location_name = location;
+  preference_name = preference;
+}
+
 void GrowthImage::Seed(int seed){
+  this->seed = seed;
+  seed_from_time = false;
   rng = std::mt19937(seed);
 }
 
@@ -122,26 +300,108 @@ void GrowthImage::SetInitialLocationGenerator(InitialLocationGenerator func){
 
 void GrowthImage::SetLocationGenerator(LocationGenerator func){
   location_generator = func;
+  compiled_generators = nullptr;
 }
 
 void GrowthImage::SetPreferenceGenerator(PreferenceGenerator func){
   preference_generator = func;
+  compiled_generators = nullptr;
 }
 
 void GrowthImage::SetTargetColorGenerator(TargetColorGenerator func){
   target_color_generator = func;
+  compiled_generators = nullptr;
+}
+
+void GrowthImage::SetPreferenceBatchGenerator(PreferenceBatchGenerator func){
+  preference_batch_generator = func;
+}
+
+void GrowthImage::SetTargetColorBatchGenerator(TargetColorBatchGenerator func){
+  target_color_batch_generator = func;
+}
+
+void GrowthImage::SetFrontierOrder(FrontierOrder order){
+  point_tracker.SetFrontierOrder(order);
+}
+
+void GrowthImage::SetPreferencePolicy(PreferencePolicy policy){
+  preference_policy = policy;
 }
 
 void GrowthImage::SetEpsilon(double epsilon){
   this->epsilon = epsilon;
 }
 
+void GrowthImage::SetPaletteBackend(PaletteBackend backend){
+  palette.SetBackend(backend);
+}
+
+void GrowthImage::SetBatchSize(int batch_size){
+  this->batch_size = std::max(batch_size, 1);
+}
+
+void GrowthImage::SetThreads(int threads){
+  if(threads > 1){
+    thread_pool = std::unique_ptr<ThreadPool>(new ThreadPool(threads));
+  } else {
+    thread_pool = nullptr;
+  }
+}
+
+void GrowthImage::SetBuildThreads(int threads){
+  palette.SetBuildThreads(threads);
+}
+
+void GrowthImage::SetLazyPalette(bool lazy){
+  palette.SetLazyBuild(lazy);
+}
+
+void GrowthImage::SetPhaseTiming(bool enabled){
+  phase_timing = enabled;
+  phase_times = PhaseTimes();
+}
+
 double GrowthImage::GetEpsilon(){
   return epsilon;
 }
 
+void GrowthImage::SetStatsMode(StatsMode mode){
+  stats = StatsBuffer(width, height, mode, map_directory);
+}
+
+void GrowthImage::SetMapDirectory(const std::string& directory){
+  map_directory = directory;
+  allocate_buffers();
+}
+
+void GrowthImage::allocate_buffers(){
+  // Release the old buffers first, to not hold both at once.
+  pixels = ImageBuffer<Color>();
+  StatsMode stats_mode = stats.GetMode();
+  stats = StatsBuffer();
+  FrontierOrder order = point_tracker.GetFrontierOrder();
+  point_tracker = PointTracker(0, 0);
+
+  pixels = ImageBuffer<Color>(width, height, Color(0,0,0), map_directory);
+  stats = StatsBuffer(width, height, stats_mode, map_directory);
+  point_tracker = PointTracker(width, height, map_directory);
+  point_tracker.SetFrontierOrder(order);
+  batch_claims.clear();
+  deferred_locations.clear();
+  num_filled = 0;
+}
+
+const std::vector<Color>& GrowthImage::GetPixels() const {
+  if(pixels.IsMapped()){
+    throw std::runtime_error("Pixels held in mapped files cannot be read as a whole");
+  }
+  return pixels.GetMemory();
+}
+
 void GrowthImage::Reset(){
   point_tracker.Clear();
+  num_filled = 0;
 }
 
 void GrowthImage::FirstIteration(){
@@ -152,100 +412,283 @@ void GrowthImage::FirstIteration(){
 }
 
 bool GrowthImage::Iterate(){
-  if(!palette.ColorsRemaining()){
-    palette.SetPalette(palette_generator(rand_int, GetWidth() * GetHeight()));
-  }
-  if(!point_tracker.FrontierSize()){
-    FirstIteration();
+  if(compiled_generators){
+    return compiled_generators->Iterate(*this);
   }
-
-  auto loc = ChooseLocation();
-  auto res = ChooseColor(loc);
-  auto index = get_index(loc);
-  pixels[index] = res.res;
-  stats[index] = res.stats;
-
-  point_tracker.Fill(
-    loc,
-    [&](Point pos) {
-      return preference_generator(rand_int, pos, point_tracker);
-    });
-
-  return point_tracker.FrontierSize();
+  return IterateWith(location_generator, preference_generator, target_color_generator);
 }
 
 void GrowthImage::IterateUntilDone(){
-  int body_size = 0;
+  int reported = -1;
+  bool palette_reported = false;
+  int checkpointed = checkpoint_every ? num_filled / checkpoint_every : 0;
   while(Iterate()){
-    if(body_size % 100000 == 0){
+    if(checkpoint_every && num_filled / checkpoint_every != checkpointed){
+      checkpointed = num_filled / checkpoint_every;
+      SaveCheckpoint(checkpoint_filename);
+    }
+    if(!palette_reported && palette.GetPaletteSize()){
+      palette_reported = true;
+      std::cout << "Palette: " << palette.GetPaletteSize() << " colors in "
+                << palette_backend_name(palette.GetEngineBackend()) << ", "
+                << double(palette.MemoryUsage())/palette.GetPaletteSize() << " bytes per color, "
+                << "built in " << palette.GetBuildSeconds() << " s"
+                << std::endl;
+    }
+    if(num_filled / 100000 != reported){
+      reported = num_filled / 100000;
       std::cout << "\r                                                   \r"
-                << "Body: " << body_size << "\tFrontier: " << point_tracker.FrontierSize()
-                << "\tUnexplored: " << pixels.size() - body_size - point_tracker.FrontierSize()
+                << "Body: " << num_filled << "\tFrontier: " << point_tracker.FrontierSize()
+                << "\tUnexplored: " << size_t(width)*height - num_filled - point_tracker.FrontierSize()
                 << std::flush;
     }
-    body_size++;
   }
   std::cout << std::endl;
 }
 
-Point GrowthImage::ChooseLocation(){
-  return location_generator(rand_int, point_tracker);
+namespace {
+  const char checkpoint_magic[8] = {'O','M','N','I','C','K','P','T'};
+  const int checkpoint_version = 4;
+
+  const char* preference_policy_name(PreferencePolicy policy){
+    switch(policy){
+    case PreferencePolicy::EveryNeighbor:
+      return "EveryNeighbor";
+    case PreferencePolicy::OnEntry:
+      return "OnEntry";
+    case PreferencePolicy::OnFill:
+      return "OnFill";
+    }
+    return "Unknown";
+  }
+
+  template<typename T>
+  void check_checkpoint_option(const std::string& option, const T& saved, const T& current){
+    if(saved != current){
+      std::stringstream ss;
+      ss << "Checkpoint was made with " << option << " " << saved
+         << ", not " << current;
+      throw std::runtime_error(ss.str());
+    }
+  }
+}
+
+void GrowthImage::SetCheckpointing(const std::string& filename, int every){
+  checkpoint_filename = filename;
+  checkpoint_every = std::max(every, 0);
+}
+
+void GrowthImage::SaveCheckpoint(const std::string& filename){
+  if(state){
+    throw std::runtime_error("Checkpoints are not supported for lua scripts");
+  }
+
+  CheckpointWriter writer(filename);
+  writer.WriteArray(checkpoint_magic, sizeof(checkpoint_magic));
+  writer.Write<int>(checkpoint_version);
+  writer.Write<int>(width);
+  writer.Write<int>(height);
+  writer.WriteString(location_name);
+  writer.WriteString(preference_name);
+  writer.Write<int>(int(preference_policy));
+  writer.Write<int>(batch_size);
+  writer.Write<double>(epsilon);
+  writer.Write<int>(int(palette.GetBackend()));
+  writer.Write<char>(thread_pool != nullptr);
+  writer.Write<int>(seed);
+  writer.Write<int>(num_filled);
+
+  std::ostringstream rng_state;
+  rng_state << rng;
+  writer.WriteString(rng_state.str());
+
+  writer.Write<char>(pixels.IsMapped());
+  writer.WriteArray(pixels.data(), pixels.size());
+  stats.Save(writer);
+  point_tracker.Save(writer);
+  palette.Save(writer);
+  writer.WriteVector(deferred_locations);
+
+  writer.Write<char>(compiled_generators != nullptr);
+  if(compiled_generators){
+    compiled_generators->SaveState(writer);
+  }
+
+  writer.Close();
+}
+
+void GrowthImage::LoadCheckpoint(const std::string& filename){
+  if(state){
+    throw std::runtime_error("Checkpoints are not supported for lua scripts");
+  }
+
+  CheckpointReader reader(filename);
+  char magic[sizeof(checkpoint_magic)];
+  try {
+    reader.ReadArray(magic, sizeof(magic));
+  } catch (std::runtime_error&) {
+    throw std::runtime_error(filename + " is not a checkpoint");
+  }
+  if(!std::equal(magic, magic+sizeof(magic), checkpoint_magic) ||
+     reader.Read<int>() != checkpoint_version){
+    throw std::runtime_error(filename + " is not a checkpoint");
+  }
+  if(reader.Read<int>() != width || reader.Read<int>() != height){
+    throw std::runtime_error("Checkpoint does not match this image");
+  }
+  check_checkpoint_option("location generator", reader.ReadString(), location_name);
+  check_checkpoint_option("preference generator", reader.ReadString(), preference_name);
+  int policy = reader.Read<int>();
+  check_checkpoint_option<std::string>(
+    "preference policy",
+    preference_policy_name(PreferencePolicy(policy)),
+    preference_policy_name(preference_policy));
+  check_checkpoint_option("batch size", reader.Read<int>(), batch_size);
+  check_checkpoint_option("epsilon", reader.Read<double>(), epsilon);
+  int backend = reader.Read<int>();
+  check_checkpoint_option<std::string>(
+    "palette backend",
+    palette_backend_name(PaletteBackend(backend)),
+    palette_backend_name(palette.GetBackend()));
+  // Batches are found differently with a thread pool, but the same
+  // for any number of threads above 1.
+  bool threaded = reader.Read<char>();
+  check_checkpoint_option<std::string>(
+    "threads",
+    threaded ? "above 1" : "1",
+    thread_pool ? "above 1" : "1");
+  int saved_seed = reader.Read<int>();
+  if(seed_from_time){
+    // No seed was given, so continue with the seed of the checkpoint.
+    seed = saved_seed;
+    seed_from_time = false;
+  } else {
+    check_checkpoint_option("seed", saved_seed, seed);
+  }
+  num_filled = reader.Read<int>();
+
+  std::istringstream rng_state(reader.ReadString());
+  rng_state >> rng;
+
+  // Mapped buffers are tiled, so both must be stored the same way.
+  if(reader.Read<char>() != pixels.IsMapped()){
+    throw std::runtime_error("Checkpoint does not match this image");
+  }
+  reader.ReadArray(pixels.data(), pixels.size());
+  stats.Load(reader);
+  point_tracker.Load(reader);
+  palette.Load(reader);
+
+  deferred_locations = reader.ReadVector<Point>();
+  batch_claims.assign(pixels.size(), unclaimed);
+  for(auto loc : deferred_locations){
+    batch_claims[get_index(loc)] = deferred;
+  }
+
+  bool has_generator_state = reader.Read<char>();
+  if(has_generator_state != (compiled_generators != nullptr)){
+    throw std::runtime_error("Checkpoint does not match this image");
+  }
+  if(compiled_generators){
+    compiled_generators->LoadState(reader);
+  }
 }
 
-KDTree_Result<Color> GrowthImage::ChooseColor(Point loc){
-  // Find the average surrounding color.
-  std::vector<Color> neighbors;
+void GrowthImage::ClaimLocation(Point loc, int n, std::vector<Point>& locations){
+  auto index = get_index(loc);
+  if(point_tracker.IsFilled(loc) || batch_claims[index] != unclaimed){
+    return;
+  }
+
+  // Pixels filled together do not see each other's colors, and so
+  // must not be neighbors.
+  bool next_to_batch = false;
   for(int di=-1; di<=1; di++){
     for(int dj=-1; dj<=1; dj++){
-      Point p(loc.i+di,loc.j+dj);
-      auto index = get_index(p);
-      if((index!=size_t(-1)) &&
-         point_tracker.IsFilled(p.i,p.j)){
-        neighbors.push_back(pixels[index]);
+      auto neighbor = get_index(loc.i+di, loc.j+dj);
+      if(neighbor != size_t(-1) && batch_claims[neighbor] == in_batch){
+        next_to_batch = true;
       }
     }
   }
 
-  Color target = target_color_generator(rand_int, std::move(neighbors), loc);
-  return palette.PopClosest(target, epsilon);
+  if(next_to_batch || int(locations.size()) >= n){
+    batch_claims[index] = deferred;
+    deferred_locations.push_back(loc);
+  } else {
+    batch_claims[index] = in_batch;
+    locations.push_back(loc);
+  }
 }
 
-size_t GrowthImage::get_index(int i, int j) {
-  if ( i>=0 && i<GetWidth() &&
-       j>=0 && j<GetHeight() ) {
-    return j*width + i;
+void GrowthImage::SetTrackChangedTiles(bool enabled){
+  track_changed_tiles = enabled;
+  changed_tiles.clear();
+  if(enabled){
+    int tiles_across = (width + tile_size - 1)/tile_size;
+    int tiles_down = (height + tile_size - 1)/tile_size;
+    tile_changed.assign(tiles_across*tiles_down, false);
   } else {
-    return -1;
+    tile_changed.clear();
   }
 }
 
-size_t GrowthImage::get_index(Point p) {
-  return get_index(p.i, p.j);
+std::function<void(std::vector<Point>&)> GrowthImage::batch_preferences(){
+  return [this](std::vector<Point>& points){
+    auto preferences = preference_batch_generator(rand_int, points, point_tracker);
+    if(preferences.size() != points.size()){
+      throw std::runtime_error("Batch preference generator returned the wrong number of preferences");
+    }
+    for(size_t i=0; i<points.size(); i++){
+      points[i].preference = preferences[i];
+    }
+  };
+}
+
+void GrowthImage::ClearChangedTiles(){
+  for(int tile : changed_tiles){
+    tile_changed[tile] = false;
+  }
+  changed_tiles.clear();
+}
+
+void GrowthImage::SetPNGOptions(const PNGOptions& options){
+  png_options = options;
 }
 
 void GrowthImage::Save(const std::string &filepath) {
-  SavePNG(pixels, width, height, filepath);
+  SavePNG([this](int j, Color* buffer){
+      return pixels.Row(j, buffer);
+    },
+    width, height, filepath, png_options);
 }
 
 void GrowthImage::SaveStats(const std::string &filepath) {
-  PerformanceStats max;
-  for(auto& s : stats) {
-    max.nodes_checked = std::max(max.nodes_checked, s.nodes_checked);
-    max.leaf_nodes_checked = std::max(max.leaf_nodes_checked,
-                                      s.leaf_nodes_checked);
-    max.points_checked = std::max(max.points_checked, s.points_checked);
+  if(stats.GetMode() == StatsMode::None){
+    throw std::runtime_error("Stats were not kept for this image");
   }
 
-
-  std::vector<Color> stat_pixels;
-  stat_pixels.reserve(width*height);
-
-  for(auto& s : stats) {
-    unsigned char r = 255 * std::log(s.nodes_checked) / std::log(max.nodes_checked);
-    unsigned char g = 255 * std::log(s.leaf_nodes_checked) / std::log(max.leaf_nodes_checked);
-    unsigned char b = 255 * std::log(s.points_checked) / std::log(max.points_checked);
-    stat_pixels.push_back({r,g,b});
+  PerformanceStats max;
+  for(int j=0; j<height; j++) {
+    for(int i=0; i<width; i++) {
+      auto s = stats.Get(get_index(i,j));
+      max.nodes_checked = std::max(max.nodes_checked, s.nodes_checked);
+      max.leaf_nodes_checked = std::max(max.leaf_nodes_checked,
+                                        s.leaf_nodes_checked);
+      max.points_checked = std::max(max.points_checked, s.points_checked);
+    }
   }
 
-  SavePNG(stat_pixels, width, height, filepath);
+  // Each row is colored as it is written, rather than all at once.
+  SavePNG([this,&max](int j, Color* buffer){
+      for(int i=0; i<width; i++) {
+        auto s = stats.Get(get_index(i,j));
+        unsigned char r = 255 * std::log(s.nodes_checked) / std::log(max.nodes_checked);
+        unsigned char g = 255 * std::log(s.leaf_nodes_checked) / std::log(max.leaf_nodes_checked);
+        unsigned char b = 255 * std::log(s.points_checked) / std::log(max.points_checked);
+        buffer[i] = {r,g,b};
+      }
+      return buffer;
+    },
+    width, height, filepath, png_options);
 }
@@ -0,0 +1,39 @@
+#include "ImageBuffer.hh"
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+MappedFile::MappedFile(const std::string& directory, size_t bytes)
+  : data(nullptr), bytes(bytes) {
+  std::string name = directory + "/growth-XXXXXX";
+  std::vector<char> filename(name.begin(), name.end());
+  filename.push_back('\0');
+
+  int fd = mkstemp(filename.data());
+  if(fd == -1){
+    throw std::runtime_error("Could not create file in " + directory + ": " + strerror(errno));
+  }
+  // The mapping keeps the file alive, so it is removed right away to
+  // avoid leaving it behind.
+  unlink(filename.data());
+
+  if(ftruncate(fd, bytes)){
+    close(fd);
+    throw std::runtime_error("Could not resize file in " + directory + ": " + strerror(errno));
+  }
+  void* mapping = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if(mapping == MAP_FAILED){
+    throw std::runtime_error(std::string("Could not map file: ") + strerror(errno));
+  }
+  data = mapping;
+}
+
+MappedFile::~MappedFile(){
+  munmap(data, bytes);
+}
@@ -0,0 +1,171 @@
+#include "PackedKDTree.hh"
+
+#include <cassert>
+
+PackedKDTree::PackedKDTree(std::vector<Color> colors, std::shared_ptr<ThreadPool> pool)
+  : pool(pool), generation(0), values(build(std::move(colors))) { }
+
+PackedKDTree::PackedKDTree(CheckpointReader& reader, std::shared_ptr<ThreadPool> pool)
+  : pool(pool), nodes(reader.ReadVector<Node>()), built_size(reader.Read<uint64_t>()),
+    generation(0), values(reader) {
+  if(nodes.empty()){
+    throw std::runtime_error("Invalid tree in checkpoint");
+  }
+}
+
+void PackedKDTree::Save(CheckpointWriter& writer) const {
+  writer.WriteVector(nodes);
+  writer.Write<uint64_t>(built_size);
+  values.Save(writer);
+}
+
+size_t PackedKDTree::MemoryUsage() const {
+  return nodes.capacity()*sizeof(Node) + values.MemoryUsage();
+}
+
+std::vector<Color> PackedKDTree::build(std::vector<Color> colors){
+  assert(colors.size() > 0);
+  assert(colors.size() <= UINT32_MAX);
+  built_size = colors.size();
+  generation++;
+  nodes.clear();
+  auto splits = kdtree_partition(colors.data(), colors.size(), pool.get());
+  size_t next_split = 0;
+  make_node(0, colors.size(), splits, next_split);
+  nodes.shrink_to_fit();
+  return colors;
+}
+
+void PackedKDTree::rebuild(){
+  std::vector<Color> remaining;
+  remaining.reserve(GetNumLeaves());
+  for(const auto& node : nodes){
+    if(node.dimension == is_leaf){
+      for(uint32_t i=0; i<node.num_leaves; i++){
+        remaining.push_back(values.Get(node.link + i));
+      }
+    }
+  }
+  values = LeafValues<Color>(build(std::move(remaining)));
+}
+
+void PackedKDTree::make_node(size_t begin, size_t n,
+                             const std::vector<KDTreeSplit>& splits, size_t& next_split){
+  assert(n>0);
+  KDTreeSplit split = splits[next_split++];
+  size_t median_index = split.median_index;
+  int dimension = split.dimension;
+  if(!median_index){
+    // Either few enough values for a leaf, or every value is equal.
+    nodes.push_back({uint32_t(n), uint32_t(begin), is_leaf, 0});
+    return;
+  }
+
+  size_t index = nodes.size();
+  nodes.push_back({uint32_t(n), 0, uint8_t(dimension), uint8_t(split.median)});
+  make_node(begin, median_index, splits, next_split);
+  nodes[index].link = nodes.size();
+  make_node(begin+median_index, n-median_index, splits, next_split);
+}
+
+KDTree_Result<Color> PackedKDTree::PopClosest(Color query, double epsilon){
+  KDTree_Result<Color> output;
+  auto res = closest_node(0, query, epsilon, output.stats);
+  output.res = values.Get(res.index);
+  pop_index(res.leaf, res.index);
+  return output;
+}
+
+void PackedKDTree::pop_index(uint32_t leaf_index, size_t index){
+  Node& leaf = nodes[leaf_index];
+  values.Swap(index, leaf.link + leaf.num_leaves - 1);
+
+  // The leaf is in the left subtree of a node exactly when it comes
+  // before the right child.
+  uint32_t node = 0;
+  while(node != leaf_index){
+    nodes[node].num_leaves--;
+    node = (leaf_index < nodes[node].link) ? node+1 : nodes[node].link;
+  }
+  leaf.num_leaves--;
+
+  size_t remaining = GetNumLeaves();
+  if(remaining > 0 && remaining < built_size*kdtree_rebuild_fraction){
+    rebuild();
+  }
+}
+
+void PackedKDTree::FindClosest(const Color* queries, size_t n, double epsilon,
+                               KDTree_Found<Color>* output) const {
+  for(size_t i=0; i<n; i++){
+    output[i] = KDTree_Found<Color>();
+    auto res = closest_node(0, queries[i], epsilon, output[i].result.stats);
+    output[i].result.res = values.Get(res.index);
+    output[i].leaf = res.leaf;
+    output[i].index = res.index;
+    output[i].generation = generation;
+  }
+}
+
+KDTree_Result<Color> PackedKDTree::PopFound(const KDTree_Found<Color>& found, Color query,
+                                            double epsilon){
+  if(found.generation == generation &&
+     found.leaf >= 0 && size_t(found.leaf) < nodes.size()){
+    const Node& leaf = nodes[found.leaf];
+    if(leaf.dimension == is_leaf &&
+       found.index >= leaf.link && found.index < leaf.link + leaf.num_leaves &&
+       values.Get(found.index) == found.result.res){
+      pop_index(found.leaf, found.index);
+      return found.result;
+    }
+  }
+
+  auto output = PopClosest(query, epsilon);
+  output.stats += found.result.stats;
+  return output;
+}
+
+KDTree_Result<Color> PackedKDTree::GetClosest(Color query, double epsilon){
+  KDTree_Result<Color> output;
+  auto res = closest_node(0, query, epsilon, output.stats);
+  output.res = values.Get(res.index);
+  return output;
+}
+
+PackedKDTree::SearchRes PackedKDTree::closest_node(uint32_t index, Color query, double epsilon,
+                                                   PerformanceStats& stats) const {
+  const Node& node = nodes[index];
+  assert(node.num_leaves > 0);
+
+  stats.nodes_checked += 1;
+
+  if(node.dimension == is_leaf){
+    stats.leaf_nodes_checked += 1;
+    stats.points_checked += node.num_leaves;
+
+    auto res = values.Closest(query, node.link, node.link + node.num_leaves);
+    return {res.first, index, res.second};
+  }
+
+  uint32_t left = index + 1;
+  uint32_t right = node.link;
+
+  // If one of the branches is empty, this becomes really easy.
+  if(nodes[left].num_leaves == 0){
+    return closest_node(right, query, epsilon, stats);
+  } else if(nodes[right].num_leaves == 0){
+    return closest_node(left, query, epsilon, stats);
+  }
+
+  // Check on the side that is recommended by the median heuristic.
+  double diff = query.get(node.dimension) - double(node.median);
+  auto res1 = closest_node((diff<0) ? left : right, query, epsilon, stats);
+  double allowed_diff = diff*(1+epsilon);
+  if(allowed_diff * allowed_diff > res1.dist2){
+    return res1;
+  }
+
+  // Couldn't bail out early, so check on the other side and compare.
+  auto res2 = closest_node((diff<0) ? right : left, query, epsilon, stats);
+  return (res1.dist2 < res2.dist2) ? res1 : res2;
+}
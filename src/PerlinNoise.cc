@@ -21,6 +21,20 @@ PerlinNoise::PerlinNoise(std::mt19937& rng) : octaves(1), grid_size(1){
   std::shuffle(permute.begin(), permute.end(), rng);
 }
 
+void PerlinNoise::SaveState(CheckpointWriter& writer) const {
+  writer.WriteArray(gradients.data(), gradients.size());
+  writer.WriteArray(permute.data(), permute.size());
+  writer.Write<int>(octaves);
+  writer.Write<double>(grid_size);
+}
+
+void PerlinNoise::LoadState(CheckpointReader& reader){
+  reader.ReadArray(gradients.data(), gradients.size());
+  reader.ReadArray(permute.data(), permute.size());
+  octaves = reader.Read<int>();
+  grid_size = reader.Read<double>();
+}
+
 double PerlinNoise::operator()(double x, double y){
   return (*this)({x,y});
 }
@@ -36,6 +50,59 @@ double PerlinNoise::operator()(GVector<2> p){
   return output;
 }
 
+void PerlinNoise::Row(int j, int width, double* output){
+  std::fill(output, output+width, 0.0);
+  if(width <= 0){
+    return;
+  }
+
+  // Scaling by a power of two is exact, so this matches doubling the
+  // position once per octave.
+  double y = j/grid_size;
+  std::vector<double> low_x, low_y, high_x, high_y;
+  for(int octave=0; octave<octaves; octave++){
+    double scale = std::ldexp(1.0, octave);
+    double weight = std::pow(0.5, octave);
+
+    double py = y*scale;
+    int cj = py;
+    double fy = py - cj;
+    double ty = smooth(fy);
+
+    // Gradients at the lattice points just below and above the row.
+    int cells = int(((width-1)/grid_size)*scale) + 2;
+    low_x.resize(cells);
+    low_y.resize(cells);
+    high_x.resize(cells);
+    high_y.resize(cells);
+    for(int ci=0; ci<cells; ci++){
+      GVector<2> low = gradient_at(ci, cj);
+      GVector<2> high = gradient_at(ci, cj+1);
+      low_x[ci] = low.X();
+      low_y[ci] = low.Y();
+      high_x[ci] = high.X();
+      high_y[ci] = high.Y();
+    }
+
+    for(int i=0; i<width; i++){
+      double px = (i/grid_size)*scale;
+      int ci = px;
+      double fx = px - ci;
+
+      double v_dd = low_x[ci]*fx + low_y[ci]*fy;
+      double v_du = high_x[ci]*fx + high_y[ci]*(fy-1);
+      double v_ud = low_x[ci+1]*(fx-1) + low_y[ci+1]*fy;
+      double v_uu = high_x[ci+1]*(fx-1) + high_y[ci+1]*(fy-1);
+
+      double v_d = (1-ty)*v_dd + ty*v_du;
+      double v_u = (1-ty)*v_ud + ty*v_uu;
+
+      double tx = smooth(fx);
+      output[i] += ((1-tx)*v_d + tx*v_u)*weight;
+    }
+  }
+}
+
 double PerlinNoise::base_perlin(GVector<2> p){
   int i = p.X();
   int j = p.Y();
@@ -63,7 +130,11 @@ GVector<2> PerlinNoise::gradient_at(int i, int j){
 }
 
 double PerlinNoise::interpolate(double v0, double v1, double t){
-  //t = t*t*(3-2*t); //Zero derivative at endpoint
-  t = t*t*t*(10 + t*(-15 + t*6)); //Zero derivative and zero second derivative
+  t = smooth(t);
   return (1-t)*v0 + t*v1;
 }
+
+double PerlinNoise::smooth(double t){
+  //return t*t*(3-2*t); //Zero derivative at endpoint
+  return t*t*t*(10 + t*(-15 + t*6)); //Zero derivative and zero second derivative
+}
@@ -1,40 +1,78 @@
 #include "PointTracker.hh"
 
-PointTracker::PointTracker(int width, int height)
-  : width(width), height(height) {
-  filled.assign(width*height, false);
-}
+PointTracker::PointTracker(int width, int height, const std::string& map_directory)
+  : order(FrontierOrder::Unordered), width(width), height(height),
+    pixel_state(width, height, empty, map_directory) { }
 
 void PointTracker::Clear(){
-  filled.assign(width*height, false);
-  frontier_map.clear();
+  pixel_state.Fill(empty);
   frontier_vector.clear();
 }
 
-int PointTracker::FrontierSize() const {
-  return frontier_vector.size();
+void PointTracker::SetFrontierOrder(FrontierOrder order){
+  this->order = order;
+  if(order == FrontierOrder::MaxPreference){
+    for(int i = FrontierSize()/2 - 1; i>=0; i--){
+      SiftDown(i);
+    }
+  }
 }
 
-bool PointTracker::IsFilled(Point p) const {
-  return filled[p.j*width + p.i];
+void PointTracker::Save(CheckpointWriter& writer) const {
+  writer.Write<int>(int(order));
+
+  std::vector<uint64_t> filled_mask((pixel_state.size() + 63)/64, 0);
+  for(size_t i=0; i<pixel_state.size(); i++){
+    if(pixel_state[i] == filled){
+      filled_mask[i/64] |= uint64_t(1) << (i%64);
+    }
+  }
+  writer.WriteVector(filled_mask);
+  writer.WriteVector(frontier_vector);
 }
 
-bool PointTracker::IsFilled(int i, int j) const {
-  return filled[j*width + i];
+void PointTracker::Load(CheckpointReader& reader){
+  order = FrontierOrder(reader.Read<int>());
+
+  std::vector<uint64_t> filled_mask((pixel_state.size() + 63)/64);
+  reader.ReadArray(filled_mask.data(), filled_mask.size());
+  for(size_t i=0; i<pixel_state.size(); i++){
+    pixel_state[i] = ((filled_mask[i/64] >> (i%64)) & 1) ? filled : empty;
+  }
+
+  frontier_vector = reader.ReadVector<Point>();
+  for(size_t index=0; index<frontier_vector.size(); index++){
+    const Point& p = frontier_vector[index];
+    if(p.i<0 || p.i>=width || p.j<0 || p.j>=height ||
+       pixel_state(p.i, p.j) != empty){
+      throw std::runtime_error("Invalid frontier in checkpoint");
+    }
+    pixel_state(p.i, p.j) = index;
+  }
+}
+
+int PointTracker::FrontierSize() const {
+  return frontier_vector.size();
 }
 
 void PointTracker::AddToFrontier(Point p){
   if(p.i>=0 && p.i<width &&
-     p.j>=0 && p.j<height &&
-     !IsInFrontier(p) &&
-     !IsFilled(p)){
-    frontier_map[p] = frontier_vector.size();
-    frontier_vector.push_back(p);
+     p.j>=0 && p.j<height){
+    int32_t& state = pixel_state(p.i, p.j);
+    if(state == empty){
+      state = frontier_vector.size();
+      frontier_vector.push_back(p);
+      if(order == FrontierOrder::MaxPreference){
+        SiftUp(state);
+      }
+    }
   }
 }
 
 bool PointTracker::IsInFrontier(Point p) const {
-  return frontier_map.count(p);
+  return (p.i>=0 && p.i<width &&
+          p.j>=0 && p.j<height &&
+          pixel_state(p.i, p.j) >= 0);
 }
 
 Point& PointTracker::FrontierAtIndex(int i){
@@ -46,11 +84,68 @@ Point PointTracker::FrontierAtIndex(int i) const {
 }
 
 void PointTracker::RemoveFromFrontier(Point p){
-  if(IsInFrontier(p)){
-    int index = frontier_map.at(p);
-    frontier_map[frontier_vector.back()] = index;
-    std::swap(frontier_vector[index], frontier_vector.back());
+  int32_t& state = pixel_state(p.i, p.j);
+  if(state >= 0){
+    int index = state;
+    state = empty;
+    Point last = frontier_vector.back();
     frontier_vector.pop_back();
-    frontier_map.erase(p);
+    if(index == FrontierSize()){
+      return;
+    }
+
+    SetFrontierIndex(index, last);
+    if(order == FrontierOrder::MaxPreference){
+      SiftUp(index);
+      SiftDown(pixel_state(last.i, last.j));
+    }
+  }
+}
+
+void PointTracker::SetPreference(int index, double preference){
+  frontier_vector[index].preference = preference;
+  if(order == FrontierOrder::MaxPreference){
+    Point p = frontier_vector[index];
+    SiftUp(index);
+    SiftDown(pixel_state(p.i, p.j));
+  }
+}
+
+void PointTracker::SetFrontierIndex(int index, Point p){
+  frontier_vector[index] = p;
+  pixel_state(p.i, p.j) = index;
+}
+
+void PointTracker::SiftUp(int index){
+  Point p = frontier_vector[index];
+  while(index > 0){
+    int parent = (index-1)/2;
+    if(frontier_vector[parent].preference >= p.preference){
+      break;
+    }
+    SetFrontierIndex(index, frontier_vector[parent]);
+    index = parent;
+  }
+  SetFrontierIndex(index, p);
+}
+
+void PointTracker::SiftDown(int index){
+  Point p = frontier_vector[index];
+  int size = FrontierSize();
+  while(true){
+    int child = 2*index + 1;
+    if(child >= size){
+      break;
+    }
+    if(child+1 < size &&
+       frontier_vector[child+1].preference > frontier_vector[child].preference){
+      child++;
+    }
+    if(frontier_vector[child].preference <= p.preference){
+      break;
+    }
+    SetFrontierIndex(index, frontier_vector[child]);
+    index = child;
   }
+  SetFrontierIndex(index, p);
 }
@@ -1,35 +1,327 @@
 #include "SavePNG.hh"
 
-#include <boost/version.hpp>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <stdexcept>
 
-//In a separate file because this boost header file takes forever to compile.
-#if (BOOST_VERSION < 106800)
-  #include <boost/gil/gil_all.hpp>
-  #include <boost/gil/extension/io/png_dynamic_io.hpp>
-#else
-  #include <boost/gil.hpp>
-  #include <boost/gil/extension/io/png/old.hpp>
-#endif
+#include <png.h>
+#include <zlib.h>
 
-void SavePNG(const std::vector<Color> pixels, int width, int height,
-             const char *filepath) {
-  boost::gil::rgb8_image_t image(width, height);
-  auto view = image._view;
+#include "ThreadPool.hh"
 
-  // No significant performance difference when using memcpy instead.
-  // memcpy(&view[0], &pixels[0], sizeof(Color)*pixels.size());
+static_assert(sizeof(Color) == 3,
+              "Color must be packed, to be used directly as png rows");
 
-  for(int j=0; j<height; j++) {
-    for(int i=0; i<width; i++) {
-      auto color = pixels[i + j*width];
-      view(i,j) = {color.r, color.g, color.b};
+namespace {
+  class FileCloser{
+  public:
+    FileCloser(FILE* file) : file(file) { }
+    ~FileCloser() { if(file) fclose(file); }
+    FILE* file;
+  };
+
+  int libpng_filter(PNGFilter filter){
+    switch(filter){
+    case PNGFilter::None:
+      return PNG_FILTER_NONE;
+    case PNGFilter::Sub:
+      return PNG_FILTER_SUB;
+    case PNGFilter::Up:
+      return PNG_FILTER_UP;
+    case PNGFilter::Average:
+      return PNG_FILTER_AVG;
+    case PNGFilter::Paeth:
+      return PNG_FILTER_PAETH;
+    case PNGFilter::Adaptive:
+    default:
+      return PNG_ALL_FILTERS;
+    }
+  }
+
+  // Writes the image with libpng, one row at a time.
+  void save_png_serial(const PNGRowSource& rows, int width, int height,
+                       FILE* file, const PNGOptions& options){
+    std::vector<Color> buffer(width);
+
+    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if(!png){
+      throw std::runtime_error("Could not create png writer");
+    }
+    png_infop info = png_create_info_struct(png);
+    if(!info || setjmp(png_jmpbuf(png))){
+      png_destroy_write_struct(&png, &info);
+      throw std::runtime_error("Could not write png");
+    }
+
+    png_init_io(png, file);
+    png_set_IHDR(png, info, width, height, 8, PNG_COLOR_TYPE_RGB,
+                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_set_compression_level(png, options.compression_level);
+    png_set_filter(png, PNG_FILTER_TYPE_BASE, libpng_filter(options.filter));
+    png_write_info(png, info);
+    for(int j=0; j<height; j++){
+      // libpng does not modify the rows it writes.
+      png_write_row(png, (png_bytep)rows(j, buffer.data()));
+    }
+    png_write_end(png, info);
+    png_destroy_write_struct(&png, &info);
+  }
+
+  // The filter types, as stored in the first byte of each filtered row.
+  enum FilterType : unsigned char { filter_none=0, filter_sub, filter_up, filter_average, filter_paeth };
+
+  unsigned char paeth_predictor(int a, int b, int c){
+    int p = a + b - c;
+    int pa = std::abs(p - a);
+    int pb = std::abs(p - b);
+    int pc = std::abs(p - c);
+    if(pa <= pb && pa <= pc){
+      return a;
+    } else if(pb <= pc){
+      return b;
+    } else {
+      return c;
+    }
+  }
+
+  // Filters a single row, writing the filter type and filtered bytes
+  // to output.  prev is NULL for the first row.
+  void filter_row(const unsigned char* row, const unsigned char* prev, size_t n,
+                  FilterType type, unsigned char* output){
+    const int bpp = sizeof(Color);
+    output[0] = type;
+    output++;
+    for(size_t i=0; i<n; i++){
+      int a = (i>=bpp) ? row[i-bpp] : 0;
+      int b = prev ? prev[i] : 0;
+      int c = (prev && i>=bpp) ? prev[i-bpp] : 0;
+      switch(type){
+      case filter_none:
+        output[i] = row[i];
+        break;
+      case filter_sub:
+        output[i] = row[i] - a;
+        break;
+      case filter_up:
+        output[i] = row[i] - b;
+        break;
+      case filter_average:
+        output[i] = row[i] - (a+b)/2;
+        break;
+      case filter_paeth:
+        output[i] = row[i] - paeth_predictor(a,b,c);
+        break;
+      }
+    }
+  }
+
+  // Filters a row, choosing the filter type for adaptive filtering by
+  // the smallest sum of absolute values, as libpng does.
+  void filter_row(const unsigned char* row, const unsigned char* prev, size_t n,
+                  PNGFilter filter, unsigned char* output, std::vector<unsigned char>& scratch){
+    switch(filter){
+    case PNGFilter::None:
+      filter_row(row, prev, n, filter_none, output);
+      return;
+    case PNGFilter::Sub:
+      filter_row(row, prev, n, filter_sub, output);
+      return;
+    case PNGFilter::Up:
+      filter_row(row, prev, n, filter_up, output);
+      return;
+    case PNGFilter::Average:
+      filter_row(row, prev, n, filter_average, output);
+      return;
+    case PNGFilter::Paeth:
+      filter_row(row, prev, n, filter_paeth, output);
+      return;
+    case PNGFilter::Adaptive:
+      break;
+    }
+
+    scratch.resize(n+1);
+    unsigned long best_sum = -1;
+    for(auto type : {filter_none, filter_sub, filter_up, filter_average, filter_paeth}){
+      filter_row(row, prev, n, type, scratch.data());
+      unsigned long sum = 0;
+      for(size_t i=1; i<=n; i++){
+        sum += std::abs((signed char)scratch[i]);
+      }
+      if(sum < best_sum){
+        best_sum = sum;
+        std::copy(scratch.begin(), scratch.end(), output);
+      }
+    }
+  }
+
+  void write_u32(unsigned char* output, uint32_t value){
+    output[0] = value >> 24;
+    output[1] = value >> 16;
+    output[2] = value >> 8;
+    output[3] = value;
+  }
+
+  void write_chunk(FILE* file, const char* type, const unsigned char* data, uint32_t length){
+    unsigned char header[8];
+    write_u32(header, length);
+    std::copy(type, type+4, header+4);
+    uLong crc = crc32(0, header+4, 4);
+    crc = crc32(crc, data, length);
+    unsigned char footer[4];
+    write_u32(footer, crc);
+
+    fwrite(header, 1, 8, file);
+    fwrite(data, 1, length, file);
+    fwrite(footer, 1, 4, file);
+  }
+
+  // Compresses strips of rows on separate threads, in the same way as
+  // pigz.  Each strip is a raw deflate stream primed with the end of
+  // the previous strip as its dictionary, ending in a sync flush so
+  // that the streams can be concatenated.  The checksums of the
+  // strips are combined into the checksum of the whole stream.
+  void save_png_parallel(const PNGRowSource& rows, int width, int height,
+                         FILE* file, const PNGOptions& options){
+    const size_t row_bytes = width*sizeof(Color);
+    const size_t filtered_row_bytes = row_bytes + 1;
+    const size_t dictionary_size = 32768;
+
+    ThreadPool pool(options.threads);
+
+    const size_t strip_rows = std::max<size_t>(1, (1<<18)/filtered_row_bytes);
+    const size_t num_strips = (height + strip_rows - 1)/strip_rows;
+    auto strip_begin = [&](size_t s){
+      return std::min<size_t>(s*strip_rows, height) * filtered_row_bytes;
+    };
+
+    // Filtering must finish before compressing, since each strip uses
+    // the filtered rows before it.
+    std::vector<unsigned char> filtered(filtered_row_bytes*height);
+    pool.ParallelFor(num_strips, [&](size_t s){
+        std::vector<unsigned char> scratch;
+        // Alternating buffers, so that the previous row stays valid.
+        std::vector<Color> buffers[2] = {std::vector<Color>(width), std::vector<Color>(width)};
+        size_t row_begin = s*strip_rows;
+        size_t row_end = std::min<size_t>((s+1)*strip_rows, height);
+
+        const Color* prev = row_begin ? rows(row_begin-1, buffers[(row_begin-1)%2].data()) : NULL;
+        for(size_t j=row_begin; j<row_end; j++){
+          const Color* row = rows(j, buffers[j%2].data());
+          filter_row((const unsigned char*)row, (const unsigned char*)prev, row_bytes,
+                     options.filter, &filtered[j*filtered_row_bytes], scratch);
+          prev = row;
+        }
+      });
+
+    std::vector<std::vector<unsigned char> > compressed(num_strips);
+    std::vector<uLong> checksums(num_strips);
+    pool.ParallelFor(num_strips, [&](size_t s){
+        size_t begin = strip_begin(s);
+        size_t end = strip_begin(s+1);
+        bool last = (s == num_strips-1);
+
+        // Same strategy as libpng uses for filtered rows.
+        int strategy = (options.filter == PNGFilter::None) ? Z_DEFAULT_STRATEGY : Z_FILTERED;
+        z_stream stream = {};
+        if(deflateInit2(&stream, options.compression_level, Z_DEFLATED,
+                        -15, 8, strategy) != Z_OK){
+          throw std::runtime_error("Could not initialize zlib");
+        }
+        if(begin > 0){
+          size_t dict_begin = begin - std::min(begin, dictionary_size);
+          deflateSetDictionary(&stream, &filtered[dict_begin], begin - dict_begin);
+        }
+
+        auto& output = compressed[s];
+        output.resize(deflateBound(&stream, end-begin) + 16);
+        stream.next_in = &filtered[begin];
+        stream.avail_in = end - begin;
+        size_t used = 0;
+        int ret;
+        while(true){
+          stream.next_out = output.data() + used;
+          stream.avail_out = output.size() - used;
+          ret = deflate(&stream, last ? Z_FINISH : Z_SYNC_FLUSH);
+          used = output.size() - stream.avail_out;
+          if(ret != Z_OK || stream.avail_out != 0){
+            break;
+          }
+          output.resize(2*output.size());
+        }
+        output.resize(used);
+        deflateEnd(&stream);
+        if(ret != (last ? Z_STREAM_END : Z_OK)){
+          throw std::runtime_error("Could not compress png");
+        }
+
+        checksums[s] = adler32(adler32(0, NULL, 0), &filtered[begin], end - begin);
+      });
+
+    // zlib header, with the compression level hint.
+    int level = options.compression_level;
+    unsigned char level_flags = (level < 2) ? 0 : (level < 6) ? 1 : (level == 6) ? 2 : 3;
+    unsigned char cmf = 0x78;
+    unsigned char flg = level_flags << 6;
+    flg += 31 - (cmf*256 + flg) % 31;
+
+    std::vector<unsigned char> idat = {cmf, flg};
+    uLong checksum = adler32(0, NULL, 0);
+    for(size_t s=0; s<num_strips; s++){
+      idat.insert(idat.end(), compressed[s].begin(), compressed[s].end());
+      checksum = adler32_combine(checksum, checksums[s], strip_begin(s+1) - strip_begin(s));
     }
+    unsigned char trailer[4];
+    write_u32(trailer, checksum);
+    idat.insert(idat.end(), trailer, trailer+4);
+
+    const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    fwrite(signature, 1, 8, file);
+
+    unsigned char ihdr[13];
+    write_u32(ihdr, width);
+    write_u32(ihdr+4, height);
+    ihdr[8] = 8;  // Bit depth
+    ihdr[9] = 2;  // RGB
+    ihdr[10] = 0; // Deflate
+    ihdr[11] = 0; // Adaptive filtering
+    ihdr[12] = 0; // No interlace
+    write_chunk(file, "IHDR", ihdr, sizeof(ihdr));
+    write_chunk(file, "IDAT", idat.data(), idat.size());
+    write_chunk(file, "IEND", NULL, 0);
+  }
+}
+
+void SavePNG(const PNGRowSource& rows, int width, int height,
+             const std::string& filepath, const PNGOptions& options) {
+  FileCloser closer(fopen(filepath.c_str(), "wb"));
+  if(!closer.file){
+    throw std::runtime_error("Could not open " + filepath);
+  }
+
+  if(options.threads > 1){
+    save_png_parallel(rows, width, height, closer.file, options);
+  } else {
+    save_png_serial(rows, width, height, closer.file, options);
   }
 
-  boost::gil::png_write_view(filepath,boost::gil::const_view(image));
+  FILE* file = closer.file;
+  closer.file = NULL;
+  if(ferror(file) | fclose(file)){
+    throw std::runtime_error("Could not write " + filepath);
+  }
+}
+
+void SavePNG(const std::vector<Color>& pixels, int width, int height,
+             const char *filepath, const PNGOptions& options) {
+  SavePNG([&pixels, width](int j, Color*){
+      return pixels.data() + size_t(j)*width;
+    },
+    width, height, filepath, options);
 }
 
-void SavePNG(const std::vector<Color> pixels, int width, int height,
-             const std::string& filepath) {
-  SavePNG(pixels, width, height, filepath.c_str());
+void SavePNG(const std::vector<Color>& pixels, int width, int height,
+             const std::string& filepath, const PNGOptions& options) {
+  SavePNG(pixels, width, height, filepath.c_str(), options);
 }
@@ -0,0 +1,95 @@
+#include "ThreadPool.hh"
+
+#include <algorithm>
+
+ThreadPool::ThreadPool(int num_threads)
+  : generation(0), active_workers(0), shutdown(false),
+    task(nullptr), task_size(0), chunk_size(1), next_index(0) {
+  for(int i=1; i<num_threads; i++){
+    workers.emplace_back(&ThreadPool::worker_loop, this);
+  }
+}
+
+ThreadPool::~ThreadPool(){
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    shutdown = true;
+  }
+  start_condition.notify_all();
+  for(auto& worker : workers){
+    worker.join();
+  }
+}
+
+void ThreadPool::ParallelFor(size_t n, const std::function<void(size_t)>& func){
+  if(workers.empty() || n <= 1){
+    for(size_t i=0; i<n; i++){
+      func(i);
+    }
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    task = &func;
+    task_size = n;
+    // Several chunks per thread, so that uneven work still balances.
+    chunk_size = std::max<size_t>(1, n / (8*GetNumThreads()));
+    next_index = 0;
+    error = nullptr;
+    active_workers = workers.size();
+    generation++;
+  }
+  start_condition.notify_all();
+
+  run_tasks();
+
+  std::unique_lock<std::mutex> lock(mutex);
+  done_condition.wait(lock, [this](){ return active_workers == 0; });
+  task = nullptr;
+  if(error){
+    std::rethrow_exception(error);
+  }
+}
+
+void ThreadPool::worker_loop(){
+  int seen_generation = 0;
+  while(true){
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      start_condition.wait(lock, [&](){ return shutdown || generation != seen_generation; });
+      if(shutdown){
+        return;
+      }
+      seen_generation = generation;
+    }
+
+    run_tasks();
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      active_workers--;
+    }
+    done_condition.notify_one();
+  }
+}
+
+void ThreadPool::run_tasks(){
+  while(true){
+    size_t begin = next_index.fetch_add(chunk_size);
+    if(begin >= task_size){
+      return;
+    }
+    size_t end = std::min(begin + chunk_size, task_size);
+    for(size_t i=begin; i<end; i++){
+      try {
+        (*task)(i);
+      } catch(...) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if(!error){
+          error = std::current_exception();
+        }
+      }
+    }
+  }
+}
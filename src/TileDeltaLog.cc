@@ -0,0 +1,158 @@
+#include "TileDeltaLog.hh"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace {
+  const char magic[4] = {'T','D','L','1'};
+}
+
+TileDeltaWriter::TileDeltaWriter(const std::string& filename, int width, int height, int tile_size)
+  : width(width), height(height), tile_size(tile_size),
+    tiles_across((width + tile_size - 1)/tile_size),
+    previous(width*height, Color(0,0,0)),
+    mask((tile_size*tile_size + 7)/8) {
+  file = fopen(filename.c_str(), "wb");
+  if(!file){
+    throw std::runtime_error("Could not open " + filename);
+  }
+  fwrite(magic, 1, sizeof(magic), file);
+  write_u32(width);
+  write_u32(height);
+  write_u32(tile_size);
+}
+
+TileDeltaWriter::~TileDeltaWriter(){
+  if(file){
+    fclose(file);
+  }
+}
+
+void TileDeltaWriter::WriteFrame(const std::vector<Color>& pixels, const std::vector<int>& changed_tiles){
+  write_u32(changed_tiles.size());
+  for(int tile : changed_tiles){
+    int i0 = (tile % tiles_across)*tile_size;
+    int j0 = (tile / tiles_across)*tile_size;
+
+    std::fill(mask.begin(), mask.end(), 0);
+    changed.clear();
+    for(int dj=0; dj<tile_size && j0+dj<height; dj++){
+      for(int di=0; di<tile_size && i0+di<width; di++){
+        size_t index = (j0+dj)*width + (i0+di);
+        Color color = pixels[index];
+        Color& prev = previous[index];
+        if(color.r != prev.r || color.g != prev.g || color.b != prev.b){
+          int bit = dj*tile_size + di;
+          mask[bit/8] |= 1 << (bit%8);
+          changed.push_back(color);
+          prev = color;
+        }
+      }
+    }
+
+    write_u32(tile);
+    fwrite(mask.data(), 1, mask.size(), file);
+    fwrite(changed.data(), sizeof(Color), changed.size(), file);
+  }
+
+  if(ferror(file)){
+    throw std::runtime_error("Could not write frame");
+  }
+}
+
+void TileDeltaWriter::Close(){
+  int err = fclose(file);
+  file = NULL;
+  if(err){
+    throw std::runtime_error("Could not finish writing delta log");
+  }
+}
+
+void TileDeltaWriter::write_u32(uint32_t value){
+  unsigned char bytes[4] = {
+    (unsigned char)(value), (unsigned char)(value >> 8),
+    (unsigned char)(value >> 16), (unsigned char)(value >> 24)
+  };
+  fwrite(bytes, 1, 4, file);
+}
+
+TileDeltaReader::TileDeltaReader(const std::string& filename){
+  file = fopen(filename.c_str(), "rb");
+  if(!file){
+    throw std::runtime_error("Could not open " + filename);
+  }
+
+  char file_magic[4];
+  read_bytes(file_magic, sizeof(file_magic));
+  if(!std::equal(file_magic, file_magic+4, magic)){
+    throw std::runtime_error(filename + " is not a tile delta log");
+  }
+
+  uint32_t values[3];
+  for(auto& value : values){
+    if(!read_u32(value)){
+      throw std::runtime_error("Truncated tile delta log");
+    }
+  }
+  width = values[0];
+  height = values[1];
+  tile_size = values[2];
+  if(tile_size <= 0){
+    throw std::runtime_error("Invalid tile size in tile delta log");
+  }
+
+  tiles_across = (width + tile_size - 1)/tile_size;
+  pixels.assign(width*height, Color(0,0,0));
+  mask.resize((tile_size*tile_size + 7)/8);
+}
+
+TileDeltaReader::~TileDeltaReader(){
+  fclose(file);
+}
+
+bool TileDeltaReader::NextFrame(){
+  uint32_t num_tiles;
+  if(!read_u32(num_tiles)){
+    return false;
+  }
+
+  int tiles_down = (height + tile_size - 1)/tile_size;
+  for(uint32_t t=0; t<num_tiles; t++){
+    uint32_t tile;
+    if(!read_u32(tile) || tile >= uint32_t(tiles_across*tiles_down)){
+      throw std::runtime_error("Invalid tile in tile delta log");
+    }
+    int i0 = (tile % tiles_across)*tile_size;
+    int j0 = (tile / tiles_across)*tile_size;
+
+    read_bytes(mask.data(), mask.size());
+    for(int bit=0; bit<tile_size*tile_size; bit++){
+      if(mask[bit/8] & (1 << (bit%8))){
+        int i = i0 + bit%tile_size;
+        int j = j0 + bit/tile_size;
+        if(i >= width || j >= height){
+          throw std::runtime_error("Invalid pixel in tile delta log");
+        }
+        read_bytes(&pixels[j*width + i], sizeof(Color));
+      }
+    }
+  }
+
+  return true;
+}
+
+bool TileDeltaReader::read_u32(uint32_t& value){
+  unsigned char bytes[4];
+  if(fread(bytes, 1, 4, file) != 4){
+    return false;
+  }
+  value = (uint32_t(bytes[0]) | (uint32_t(bytes[1]) << 8) |
+           (uint32_t(bytes[2]) << 16) | (uint32_t(bytes[3]) << 24));
+  return true;
+}
+
+void TileDeltaReader::read_bytes(void* data, size_t n){
+  if(fread(data, 1, n, file) != n){
+    throw std::runtime_error("Truncated tile delta log");
+  }
+}
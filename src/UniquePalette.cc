@@ -4,17 +4,133 @@
 #include <cmath>
 #include <cfloat>
 #include <algorithm>
+#include <chrono>
 #include <stdexcept>
 
 #include "common.hh"
+#include "FlatKDTree.hh"
+#include "GridPalette.hh"
+#include "PackedKDTree.hh"
+#include "ThreadPool.hh"
+
+const char* palette_backend_name(PaletteBackend backend){
+  switch(backend){
+  case PaletteBackend::Tree:
+    return "Tree";
+  case PaletteBackend::FlatTree:
+    return "FlatTree";
+  case PaletteBackend::Grid:
+    return "Grid";
+  case PaletteBackend::Concurrent:
+    return "Concurrent";
+  case PaletteBackend::Packed:
+    return "Packed";
+  case PaletteBackend::Auto:
+  default:
+    return "Auto";
+  }
+}
 
 UniquePalette::UniquePalette()
-  : colors(nullptr) { }
+  : backend(PaletteBackend::Auto), engine_backend(PaletteBackend::Auto),
+    palette_size(0), build_seconds(0), lazy_build(false), colors(nullptr) { }
 
 UniquePalette::~UniquePalette() { }
 
+void UniquePalette::SetBuildThreads(int threads){
+  if(threads > 1){
+    build_pool = std::make_shared<ThreadPool>(threads);
+  } else {
+    build_pool = nullptr;
+  }
+}
+
+void UniquePalette::SetBackend(PaletteBackend backend){
+  this->backend = backend;
+}
+
 void UniquePalette::SetPalette(std::vector<Color> colors){
-  this->colors = std::unique_ptr<KDTree<Color> >(new KDTree<Color>(std::move(colors)));
+  PaletteBackend backend = this->backend;
+  if(backend == PaletteBackend::Auto){
+    backend = (!lazy_build && GridPalette::IsSuitable(colors)) ?
+      PaletteBackend::Grid : PaletteBackend::FlatTree;
+  }
+  if(lazy_build && backend != PaletteBackend::FlatTree){
+    throw std::runtime_error(std::string("Only the FlatTree palette can be built lazily, not ") +
+                             palette_backend_name(backend));
+  }
+  engine_backend = backend;
+  palette_size = colors.size();
+  auto start = std::chrono::steady_clock::now();
+
+  switch(backend){
+  case PaletteBackend::Tree:
+    this->colors = std::unique_ptr<PaletteEngine>(
+      new TreePaletteEngine<KDTree<Color> >(std::move(colors), build_pool));
+    break;
+  case PaletteBackend::FlatTree:
+    this->colors = std::unique_ptr<PaletteEngine>(
+      new FlatPaletteEngine(std::move(colors), build_pool, lazy_build));
+    break;
+  case PaletteBackend::Concurrent:
+    this->colors = std::unique_ptr<PaletteEngine>(
+      new ConcurrentPaletteEngine(std::move(colors), build_pool));
+    break;
+  case PaletteBackend::Packed:
+    this->colors = std::unique_ptr<PaletteEngine>(
+      new PackedPaletteEngine(std::move(colors), build_pool));
+    break;
+  case PaletteBackend::Grid:
+  case PaletteBackend::Auto:
+    this->colors = std::unique_ptr<PaletteEngine>(new GridPalette(colors));
+    break;
+  }
+
+  build_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+void UniquePalette::Save(CheckpointWriter& writer) const {
+  writer.Write<char>(colors != nullptr);
+  if(colors){
+    writer.Write<int>(int(engine_backend));
+    writer.Write<uint64_t>(palette_size);
+    colors->Save(writer);
+  }
+}
+
+void UniquePalette::Load(CheckpointReader& reader){
+  colors = nullptr;
+  if(!reader.Read<char>()){
+    return;
+  }
+
+  engine_backend = PaletteBackend(reader.Read<int>());
+  palette_size = reader.Read<uint64_t>();
+  switch(engine_backend){
+  case PaletteBackend::Tree:
+    colors = std::unique_ptr<PaletteEngine>(
+      new TreePaletteEngine<KDTree<Color> >(reader, build_pool));
+    break;
+  case PaletteBackend::FlatTree:
+    colors = std::unique_ptr<PaletteEngine>(
+      new FlatPaletteEngine(reader, build_pool, lazy_build));
+    break;
+  case PaletteBackend::Concurrent:
+    colors = std::unique_ptr<PaletteEngine>(new ConcurrentPaletteEngine(reader));
+    break;
+  case PaletteBackend::Packed:
+    colors = std::unique_ptr<PaletteEngine>(new PackedPaletteEngine(reader, build_pool));
+    break;
+  case PaletteBackend::Grid:
+    colors = std::unique_ptr<PaletteEngine>(new GridPalette(reader));
+    break;
+  default:
+    throw std::runtime_error("Invalid palette in checkpoint");
+  }
+}
+
+size_t UniquePalette::MemoryUsage() const {
+  return colors ? colors->MemoryUsage() : 0;
 }
 
 int UniquePalette::ColorsRemaining(){
@@ -29,8 +145,68 @@ KDTree_Result<Color> UniquePalette::PopClosest(Color col, double epsilon){
   return colors->PopClosest(col, epsilon);
 }
 
+std::vector<KDTree_Result<Color> > UniquePalette::PopClosestBatch(const std::vector<Color>& targets,
+                                                                  double epsilon,
+                                                                  ThreadPool* pool){
+  assert(int(targets.size()) <= ColorsRemaining());
+
+  if(pool && pool->GetNumThreads() > 1 && colors->IsConcurrent()){
+    std::vector<KDTree_Result<Color> > output(targets.size());
+    pool->ParallelFor(targets.size(),
+                      [&](size_t i){
+                        output[i] = colors->PopClosest(targets[i], epsilon);
+                      });
+    return output;
+  }
+
+  // Targets are found and popped in Morton order of their colors.
+  std::vector<std::pair<size_t,size_t> > order;
+  order.reserve(targets.size());
+  for(size_t i=0; i<targets.size(); i++){
+    order.push_back({GridPalette::MortonIndex(targets[i]), i});
+  }
+  std::sort(order.begin(), order.end());
+
+  std::vector<KDTree_Result<Color> > output(targets.size());
+  if(!pool || pool->GetNumThreads() <= 1){
+    for(auto& item : order){
+      output[item.second] = colors->PopClosest(targets[item.second], epsilon);
+    }
+    return output;
+  }
+
+  std::vector<Color> sorted;
+  sorted.reserve(targets.size());
+  for(auto& item : order){
+    sorted.push_back(targets[item.second]);
+  }
+
+  // The searches do not modify the palette, so each thread can take a
+  // contiguous part of the sorted targets.
+  colors->FinishBuild();
+  std::vector<KDTree_Found<Color> > found(sorted.size());
+  size_t num_chunks = std::min<size_t>(pool->GetNumThreads(), sorted.size());
+  size_t chunk_size = (sorted.size() + num_chunks - 1)/num_chunks;
+  pool->ParallelFor(num_chunks,
+                    [&](size_t chunk){
+                      size_t begin = chunk*chunk_size;
+                      size_t end = std::min(begin + chunk_size, sorted.size());
+                      if(begin < end){
+                        colors->FindClosest(sorted.data() + begin, end - begin, epsilon,
+                                            found.data() + begin);
+                      }
+                    });
+
+  // A target is only searched for again if an earlier target took its
+  // color.
+  for(size_t i=0; i<sorted.size(); i++){
+    output[order[i].second] = colors->PopFound(found[i], sorted[i], epsilon);
+  }
+  return output;
+}
+
 KDTree_Result<Color> UniquePalette::PopBack(){
-  return colors->PopClosest({0,0,0});
+  return colors->PopClosest({0,0,0}, 0);
 }
 
 KDTree_Result<Color> UniquePalette::PopRandom(std::mt19937& rng){
@@ -38,7 +214,7 @@ KDTree_Result<Color> UniquePalette::PopRandom(std::mt19937& rng){
       (unsigned char)randint(rng,256),
       (unsigned char)randint(rng,256),
       (unsigned char)randint(rng,256)
-    });
+    }, 0);
 }
 
 void UniquePalette::GenerateUniformPalette(int n_colors){